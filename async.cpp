@@ -0,0 +1,264 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <string>
+
+#include "async.h"
+#include "decoder_pool.h"
+#include "log.h"
+#include "test_stream.h"
+
+void Task::promise_type::Final_awaiter::await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+	auto executor = handle.promise().executor;
+
+	// Destroy the frame before reporting, so nothing in it outlives Executor::wait
+	handle.destroy();
+
+	if (executor) {
+		executor->task_done();
+	}
+}
+
+void Task::promise_type::unhandled_exception() {
+	try {
+		std::rethrow_exception(std::current_exception());
+	}
+	catch (const std::exception& e) {
+		LOG_ERROR("Task failed with exception: %s", e.what());
+	}
+	catch (...) {
+		LOG_ERROR("Task failed with unknown exception");
+	}
+}
+
+Executor::Executor(unsigned int num_threads) {
+	if (num_threads == 0) {
+		num_threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	for (unsigned int i = 0; i < num_threads; i++) {
+		threads.emplace_back(&Executor::worker, this);
+	}
+}
+
+Executor::~Executor() {
+	wait();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+
+	work_available.notify_all();
+
+	for (auto& thread : threads) {
+		thread.join();
+	}
+}
+
+void Executor::spawn(Task task) {
+	auto handle = std::exchange(task.handle, nullptr);
+
+	handle.promise().executor = this;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		num_active_tasks++;
+	}
+
+	post(handle);
+}
+
+void Executor::wait() {
+	std::unique_lock<std::mutex> lock(mutex);
+	all_tasks_done.wait(lock, [this]() { return num_active_tasks == 0; });
+}
+
+void Executor::post(std::coroutine_handle<> handle) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		ready_queue.push_back(handle);
+	}
+
+	work_available.notify_one();
+}
+
+void Executor::task_done() {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (--num_active_tasks == 0) {
+		all_tasks_done.notify_all();
+	}
+}
+
+void Executor::worker() {
+	while (true) {
+		std::coroutine_handle<> handle;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			work_available.wait(lock, [this]() { return stopping || !ready_queue.empty(); });
+
+			if (ready_queue.empty()) {
+				return;
+			}
+
+			handle = ready_queue.front();
+			ready_queue.pop_front();
+		}
+
+		handle.resume();
+	}
+}
+
+Generator<Packet_data> packets(Demuxer& demuxer) {
+	Packet_data packet_data;
+
+	while (demuxer.demux(&packet_data)) {
+		co_yield packet_data;
+	}
+}
+
+/**
+ * @brief Removes the frame callback when async_decode finishes or its generator is destroyed
+*/
+struct Frame_callback_guard {
+	Decoder& decoder;
+
+	~Frame_callback_guard() {
+		decoder.set_frame_callback(nullptr);
+	}
+};
+
+Async_generator<Decoded_frame> async_decode(Executor& executor, Executor& blocking_executor, Decoder& decoder, Generator<Packet_data> packets) {
+	std::deque<Decoded_frame> frames;
+	Frame_callback_guard guard{ decoder };
+
+	decoder.set_frame_callback([&frames](Decoded_frame& frame) { frames.push_back(std::move(frame)); });
+
+	// Demuxing and decoding block, so they run on the blocking executor. The loop advances the packet generator
+	// there too. Frames are yielded from the executor, so the consumer continues there
+	co_await blocking_executor.schedule();
+
+	for (auto& packet_data : packets) {
+		if (!decoder.decode(packet_data.data, packet_data.size, packet_data.timestamp)) {
+			LOG_WARNING_LIMITED(10, "Could not decode packet");
+		}
+
+		co_await executor.schedule();
+
+		while (!frames.empty()) {
+			co_yield std::move(frames.front());
+			frames.pop_front();
+		}
+
+		co_await blocking_executor.schedule();
+	}
+
+	decoder.flush();
+
+	co_await executor.schedule();
+
+	while (!frames.empty()) {
+		co_yield std::move(frames.front());
+		frames.pop_front();
+	}
+}
+
+/**
+ * @brief What one stream of the async selftest decoded
+*/
+struct Async_test_result {
+	size_t num_frames = 0;
+	bool in_order = true;
+	bool ok = false;
+};
+
+Task decode_async_test_stream(Executor& executor, Executor& blocking_executor, Decoder_pool& decoder_pool, std::string path,
+	Async_test_result& result) {
+	Demuxer demuxer;
+	Stream_info stream_info;
+
+	// Opening the file and getting a decoder block as well
+	co_await blocking_executor.schedule();
+
+	if (!demuxer.init(path.c_str(), &stream_info)) {
+		co_return;
+	}
+
+	auto decoder = decoder_pool.acquire(stream_info);
+
+	if (!decoder) {
+		co_return;
+	}
+
+	{
+		auto frames = async_decode(executor, blocking_executor, *decoder, packets(demuxer));
+		long long last_timestamp = 0;
+
+		while (auto frame = co_await frames.next()) {
+			if (result.num_frames > 0 && frame->timestamp <= last_timestamp) {
+				result.in_order = false;
+			}
+
+			last_timestamp = frame->timestamp;
+			result.num_frames++;
+		}
+	}
+
+	co_await blocking_executor.schedule();
+	decoder_pool.release(std::move(decoder));
+	result.ok = true;
+}
+
+bool async_selftest(int num_streams) {
+	const int num_frames = 100;
+	const unsigned int num_blocking_threads = 4;
+	auto path = (std::filesystem::temp_directory_path() / "async_selftest.ts").string();
+	Test_stream test_stream;
+
+	test_stream.segments = { { 320, 240, num_frames } };
+
+	if (!encode_test_stream(test_stream) || !write_test_stream(test_stream, path)) {
+		return false;
+	}
+
+	std::vector<Async_test_result> results(num_streams);
+	auto start_time = std::chrono::steady_clock::now();
+
+	{
+		Decoder_pool decoder_pool;
+		Executor blocking_executor(num_blocking_threads);
+		Executor executor(2);
+
+		for (auto& result : results) {
+			executor.spawn(decode_async_test_stream(executor, blocking_executor, decoder_pool, path, result));
+		}
+
+		executor.wait();
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+	bool ok = true;
+	size_t total_frames = 0;
+
+	for (size_t i = 0; i < results.size(); i++) {
+		auto& result = results[i];
+
+		if (!result.ok || !result.in_order || result.num_frames != static_cast<size_t>(num_frames)) {
+			LOG_ERROR("Async stream %zu: %s, %zu of %d frames%s", i, result.ok ? "finished" : "failed", result.num_frames, num_frames,
+				result.in_order ? "" : ", timestamps out of order");
+			ok = false;
+		}
+
+		total_frames += result.num_frames;
+	}
+
+	std::error_code ec;
+	std::filesystem::remove(path, ec);
+
+	LOG_INFO("Async test %s: %d streams on 2 threads, demuxed and decoded on %u, %zu frames in %.2f s, %.0f fps", ok ? "passed" : "failed",
+		num_streams, num_blocking_threads, total_frames, elapsed.count(), total_frames / elapsed.count());
+
+	return ok;
+}
@@ -0,0 +1,267 @@
+#pragma once
+
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "decoder.h"
+#include "demuxer.h"
+
+class Executor;
+
+/**
+ * @brief Synchronous generator. Values are produced when iterating, eg.
+ * for (auto& packet : packets(demuxer)) { ... }
+*/
+template<typename T>
+class Generator {
+public:
+	struct promise_type {
+		std::optional<T> value;
+		std::exception_ptr exception;
+
+		Generator get_return_object() { return Generator(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		std::suspend_always yield_value(T new_value) { value = std::move(new_value); return {}; }
+		void return_void() {}
+		void unhandled_exception() { exception = std::current_exception(); }
+	};
+
+	class Iterator {
+	public:
+		Iterator(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+		T& operator*() const { return *handle.promise().value; }
+		Iterator& operator++() { advance(); return *this; }
+		bool operator==(std::default_sentinel_t) const { return !handle || handle.done(); }
+
+		void advance() {
+			handle.promise().value.reset();
+			handle.resume();
+
+			if (handle.promise().exception) {
+				std::rethrow_exception(handle.promise().exception);
+			}
+		}
+	private:
+		std::coroutine_handle<promise_type> handle;
+	};
+
+	Generator(Generator&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+	Generator(const Generator&) = delete;
+	Generator& operator=(const Generator&) = delete;
+
+	~Generator() {
+		if (handle) {
+			handle.destroy();
+		}
+	}
+
+	Iterator begin() {
+		Iterator it(handle);
+		it.advance();
+		return it;
+	}
+
+	std::default_sentinel_t end() { return {}; }
+private:
+	explicit Generator(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+	std::coroutine_handle<promise_type> handle;
+};
+
+/**
+ * @brief Asynchronous generator. The consumer gets the next value with co_await generator.next(),
+ * which returns an empty optional at the end. The producer may suspend between values, eg.
+ * with co_await executor.schedule(), and the consumer then continues on whichever thread resumes it
+*/
+template<typename T>
+class Async_generator {
+public:
+	struct promise_type;
+
+	/**
+	 * @brief Used when the producer yields or finishes; continues the consumer waiting for next()
+	*/
+	struct Transfer_to_consumer {
+		bool await_ready() noexcept { return false; }
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> producer) noexcept { return producer.promise().consumer; }
+		void await_resume() noexcept {}
+	};
+
+	struct promise_type {
+		std::optional<T> value;
+		std::coroutine_handle<> consumer;
+		std::exception_ptr exception;
+
+		Async_generator get_return_object() { return Async_generator(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		Transfer_to_consumer final_suspend() noexcept { return {}; }
+		Transfer_to_consumer yield_value(T new_value) { value = std::move(new_value); return {}; }
+		void return_void() {}
+		void unhandled_exception() { exception = std::current_exception(); }
+	};
+
+	struct Next_awaiter {
+		std::coroutine_handle<promise_type> producer;
+
+		bool await_ready() noexcept { return producer.done(); }
+
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> consumer) noexcept {
+			producer.promise().consumer = consumer;
+			producer.promise().value.reset();
+			return producer;
+		}
+
+		std::optional<T> await_resume() {
+			if (producer.promise().exception) {
+				std::rethrow_exception(producer.promise().exception);
+			}
+
+			return std::exchange(producer.promise().value, std::nullopt);
+		}
+	};
+
+	Async_generator(Async_generator&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+	Async_generator(const Async_generator&) = delete;
+	Async_generator& operator=(const Async_generator&) = delete;
+
+	~Async_generator() {
+		if (handle) {
+			handle.destroy();
+		}
+	}
+
+	/**
+	 * @brief Must not be called again until the previous call has completed
+	*/
+	Next_awaiter next() { return { handle }; }
+private:
+	explicit Async_generator(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+	std::coroutine_handle<promise_type> handle;
+};
+
+/**
+ * @brief Fire-and-forget coroutine, started with Executor::spawn. The coroutine frame is
+ * destroyed when the coroutine finishes
+*/
+class Task {
+public:
+	struct promise_type {
+		Executor* executor = nullptr;
+
+		Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+
+		struct Final_awaiter {
+			bool await_ready() noexcept { return false; }
+			void await_suspend(std::coroutine_handle<promise_type> handle) noexcept;
+			void await_resume() noexcept {}
+		};
+
+		Final_awaiter final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception();
+	};
+
+	Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+
+	~Task() {
+		if (handle) {
+			handle.destroy();
+		}
+	}
+private:
+	friend class Executor;
+	explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+	std::coroutine_handle<promise_type> handle;
+};
+
+/**
+ * @brief Runs coroutines on a small pool of threads. Coroutines give up their thread with
+ * co_await executor.schedule(), so many streams can share a few threads. Awaiting another
+ * executor's schedule() moves the coroutine to that executor, eg. for blocking work
+*/
+class Executor {
+public:
+	/**
+	 * @param num_threads Number of worker threads. 0 means one per hardware thread
+	*/
+	Executor(unsigned int num_threads = 0);
+
+	/**
+	 * @brief Waits for all spawned tasks to finish, then stops the worker threads
+	*/
+	~Executor();
+
+	struct Schedule_awaiter {
+		Executor& executor;
+
+		bool await_ready() noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> handle) { executor.post(handle); }
+		void await_resume() noexcept {}
+	};
+
+	/**
+	 * @brief Awaiting this suspends the coroutine and queues it to be resumed on a worker thread
+	*/
+	Schedule_awaiter schedule() { return { *this }; }
+
+	/**
+	 * @brief Starts a task. The executor takes ownership
+	 * @param task Task to run
+	*/
+	void spawn(Task task);
+
+	/**
+	 * @brief Blocks until all spawned tasks have finished
+	*/
+	void wait();
+private:
+	friend struct Task::promise_type::Final_awaiter;
+	void post(std::coroutine_handle<> handle);
+	void task_done();
+	void worker();
+	std::mutex mutex;
+	std::condition_variable work_available;
+	std::condition_variable all_tasks_done;
+	std::deque<std::coroutine_handle<>> ready_queue;
+	std::vector<std::thread> threads;
+	size_t num_active_tasks = 0;
+	bool stopping = false;
+};
+
+/**
+ * @brief Yields all packets of the demuxer, until the end of the stream. The data of a packet
+ * is valid until the next packet is requested
+ * @param demuxer Initialized demuxer
+*/
+Generator<Packet_data> packets(Demuxer& demuxer);
+
+/**
+ * @brief Decodes packets and yields the decoded frames in display order. Demuxing and decoding run on the
+ * blocking executor, so they don't hold up the threads of the executor, which only get the frames. Goes
+ * back to the executor after each packet, so other coroutines get to run. The decoder's frame callback
+ * is used while the generator is alive
+ * @param executor Executor running the consuming coroutine
+ * @param blocking_executor Executor for blocking work. Should have its own threads
+ * @param decoder Initialized decoder
+ * @param packets Packets to decode, eg. from packets(demuxer)
+*/
+Async_generator<Decoded_frame> async_decode(Executor& executor, Executor& blocking_executor, Decoder& decoder, Generator<Packet_data> packets);
+
+/**
+ * @brief Decodes a generated stream N times at once, each in its own coroutine with async_decode, on an
+ * executor with two threads and decoders from one pool. Demuxing and decoding run on a second executor. Checks that every stream gets all its frames,
+ * in order. Needs an H.264 encoder in FFmpeg
+ * @param num_streams Number of concurrent streams
+ * @return True if the check passed, false otherwise
+*/
+bool async_selftest(int num_streams = 8);
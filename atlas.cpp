@@ -0,0 +1,525 @@
+#include <algorithm>
+#include <cstring>
+#include <glad/glad.h>
+
+#include "atlas.h"
+#include "decoder.h"
+#include "log.h"
+#include "memory_governor.h"
+#include "render.h"
+
+/**
+ * @brief Dirty regions that overlap or are closer than this many pixels, both horizontally and vertically,
+ * are uploaded together
+*/
+const int merge_distance = 16;
+
+int align_even(int value) {
+	return (value + 1) & ~1;
+}
+
+Rect_allocator::Rect_allocator(int width, int height) : width(width), height(height) {}
+
+bool Rect_allocator::allocate(int width, int height, Atlas_rect& rect) {
+	width = align_even(width);
+	height = align_even(height);
+
+	if (width > this->width || height > this->height) {
+		return false;
+	}
+
+	Shelf* best_shelf = nullptr;
+	int best_x = 0;
+
+	for (auto& shelf : shelves) {
+		// Only use shelves of about the right height, unless they are empty, so little space is wasted
+		if (shelf.height < height || (!shelf.spans.empty() && shelf.height > height + height / 2)) {
+			continue;
+		}
+
+		if (best_shelf && best_shelf->height <= shelf.height) {
+			continue;
+		}
+
+		int x = 0;
+		bool found = false;
+
+		for (auto& [span_x, span_width] : shelf.spans) {
+			if (span_x - x >= width) {
+				found = true;
+				break;
+			}
+
+			x = span_x + span_width;
+		}
+
+		if (found || this->width - x >= width) {
+			best_shelf = &shelf;
+			best_x = x;
+		}
+	}
+
+	if (!best_shelf) {
+		if (shelves_end + height > this->height) {
+			return false;
+		}
+
+		shelves.push_back({ shelves_end, height, {} });
+		shelves_end += height;
+		best_shelf = &shelves.back();
+		best_x = 0;
+	}
+
+	auto& spans = best_shelf->spans;
+	spans.insert(std::upper_bound(spans.begin(), spans.end(), std::make_pair(best_x, 0)), { best_x, width });
+	rect = { best_x, best_shelf->y, width, height };
+
+	return true;
+}
+
+void Rect_allocator::free(const Atlas_rect& rect) {
+	for (auto& shelf : shelves) {
+		if (shelf.y != rect.y) {
+			continue;
+		}
+
+		auto& spans = shelf.spans;
+		spans.erase(std::remove_if(spans.begin(), spans.end(), [&rect](auto& span) { return span.first == rect.x; }), spans.end());
+		break;
+	}
+
+	// Empty shelves at the end can be given any height again
+	while (!shelves.empty() && shelves.back().spans.empty()) {
+		shelves_end = shelves.back().y;
+		shelves.pop_back();
+	}
+}
+
+void Rect_allocator::clear() {
+	shelves.clear();
+	shelves_end = 0;
+}
+
+Texture_atlas::Texture_atlas(int page_width, int page_height, int num_pages) : page_width(align_even(page_width)), page_height(align_even(page_height)) {
+	for (int i = 0; i < num_pages; i++) {
+		pages.push_back({ Rect_allocator(this->page_width, this->page_height), {}, {}, {} });
+	}
+}
+
+Texture_atlas::~Texture_atlas() {
+	if (shader_program) {
+		glDeleteProgram(shader_program);
+		glDeleteVertexArrays(1, &vao);
+		glDeleteBuffers(1, &instance_buffer);
+		glDeleteTextures(1, &luma_texture);
+		glDeleteTextures(1, &chroma_texture);
+	}
+
+	if (memory_stream_id >= 0) {
+		Memory_governor::get().unregister_stream(memory_stream_id);
+	}
+}
+
+bool Texture_atlas::init() {
+	size_t page_bytes = static_cast<size_t>(page_width) * page_height * 3 / 2;
+
+	memory_stream_id = Memory_governor::get().register_stream("texture atlas");
+	memory_reserved = page_bytes * pages.size();
+
+	if (!Memory_governor::get().reserve(memory_stream_id, Memory_category::frame_pool, memory_reserved)) {
+		return false;
+	}
+
+	for (auto& page : pages) {
+		page.luma.resize(static_cast<size_t>(page_width) * page_height);
+		page.chroma.resize(static_cast<size_t>(page_width) * page_height / 2);
+	}
+
+	const char* vertex_shader_source = "#version 430 core\n"
+		"layout (location = 0) in vec2 corner;\n"
+		"layout (location = 1) in vec4 screen_rect;\n"
+		"layout (location = 2) in vec4 uv_rect;\n"
+		"layout (location = 3) in float layer;\n"
+		"out vec3 uv;\n"
+		"void main()\n"
+		"{\n"
+		"	gl_Position = vec4(screen_rect.xy + corner * screen_rect.zw, 0.0, 1.0);\n"
+		"	// Rows are stored top down\n"
+		"	uv = vec3(uv_rect.x + corner.x * uv_rect.z, uv_rect.y + (1.0 - corner.y) * uv_rect.w, layer);\n"
+		"}\n";
+	const char* fragment_shader_source = "#version 430 core\n"
+		"in vec3 uv;\n"
+		"out vec4 frag_color;\n"
+		"uniform sampler2DArray luma_texture;\n"
+		"uniform sampler2DArray chroma_texture;\n"
+		"void main()\n"
+		"{\n"
+		"	// BT.709, limited range\n"
+		"	float y = (texture(luma_texture, uv).r - 16.0 / 255.0) * 255.0 / 219.0;\n"
+		"	vec2 c = (texture(chroma_texture, uv).rg - 128.0 / 255.0) * 255.0 / 224.0;\n"
+		"	frag_color = vec4(y + 1.5748 * c.y, y - 0.1873 * c.x - 0.4681 * c.y, y + 1.8556 * c.x, 1.0);\n"
+		"}\n";
+
+	shader_program = create_shader_program(vertex_shader_source, fragment_shader_source);
+
+	if (!shader_program) {
+		return false;
+	}
+
+	glUseProgram(shader_program);
+	glUniform1i(glGetUniformLocation(shader_program, "luma_texture"), 0);
+	glUniform1i(glGetUniformLocation(shader_program, "chroma_texture"), 1);
+
+	auto num_pages = static_cast<int>(pages.size());
+
+	glGenTextures(1, &luma_texture);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, luma_texture);
+	glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_R8, page_width, page_height, num_pages);
+	glGenTextures(1, &chroma_texture);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, chroma_texture);
+	glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RG8, page_width / 2, page_height / 2, num_pages);
+
+	for (auto texture : { luma_texture, chroma_texture }) {
+		glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	float corners[] = {
+		0.0f, 0.0f,
+		1.0f, 0.0f,
+		0.0f, 1.0f,
+		1.0f, 1.0f
+	};
+	unsigned int corner_buffer;
+
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+
+	glGenBuffers(1, &corner_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, corner_buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+	glEnableVertexAttribArray(0);
+
+	// Per instance: screen rect, UV rect and layer
+	const int instance_stride = 9 * sizeof(float);
+
+	glGenBuffers(1, &instance_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+	glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, instance_stride, (void*)0);
+	glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, instance_stride, (void*)(4 * sizeof(float)));
+	glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, instance_stride, (void*)(8 * sizeof(float)));
+
+	for (int location = 1; location <= 3; location++) {
+		glEnableVertexAttribArray(location);
+		glVertexAttribDivisor(location, 1);
+	}
+
+	glBindVertexArray(0);
+	// The vertex array keeps the buffer alive
+	glDeleteBuffers(1, &corner_buffer);
+
+	return true;
+}
+
+bool Texture_atlas::allocate(int width, int height, int& page, Atlas_rect& rect) {
+	for (page = 0; page < static_cast<int>(pages.size()); page++) {
+		if (pages[page].allocator.allocate(width, height, rect)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int Texture_atlas::add_stream(int width, int height) {
+	Stream stream = { 0, {}, width, height };
+
+	if (!allocate(width, height, stream.page, stream.rect) && !repack(width, height, stream.page, stream.rect)) {
+		LOG_WARNING("No space in texture atlas for a %dx%d stream", width, height);
+		return -1;
+	}
+
+	auto stream_id = next_stream_id++;
+	streams[stream_id] = stream;
+
+	return stream_id;
+}
+
+void Texture_atlas::remove_stream(int stream_id) {
+	auto it = streams.find(stream_id);
+
+	if (it == streams.end()) {
+		return;
+	}
+
+	pages[it->second.page].allocator.free(it->second.rect);
+	streams.erase(it);
+}
+
+bool Texture_atlas::resize_stream(int stream_id, int width, int height) {
+	auto it = streams.find(stream_id);
+
+	if (it == streams.end()) {
+		return false;
+	}
+
+	auto old_stream = it->second;
+	Stream resized_stream = { 0, {}, width, height };
+
+	if (allocate(width, height, resized_stream.page, resized_stream.rect)) {
+		pages[old_stream.page].allocator.free(old_stream.rect);
+		it->second = resized_stream;
+		return true;
+	}
+
+	// Repack with the stream at its new size. If that fails, nothing has changed and the stream keeps its old size
+	streams.erase(it);
+
+	if (!repack(width, height, resized_stream.page, resized_stream.rect)) {
+		streams[stream_id] = old_stream;
+		return false;
+	}
+
+	streams[stream_id] = resized_stream;
+
+	return true;
+}
+
+bool Texture_atlas::repack(int extra_width, int extra_height, int& extra_page, Atlas_rect& extra_rect) {
+	// Tallest first, which packs the shelves tightly. The extra stream has id -1
+	std::vector<std::pair<int, int>> order;
+
+	for (auto& [stream_id, stream] : streams) {
+		order.push_back({ stream.height, stream_id });
+	}
+
+	order.push_back({ extra_height, -1 });
+	std::sort(order.rbegin(), order.rend());
+
+	std::vector<Rect_allocator> allocators(pages.size(), Rect_allocator(page_width, page_height));
+	std::map<int, std::pair<int, Atlas_rect>> placements;
+
+	for (auto& [height, stream_id] : order) {
+		int width = (stream_id < 0) ? extra_width : streams[stream_id].width;
+		bool placed = false;
+
+		for (int page = 0; page < static_cast<int>(allocators.size()) && !placed; page++) {
+			Atlas_rect rect;
+
+			if (allocators[page].allocate(width, height, rect)) {
+				placements[stream_id] = { page, rect };
+				placed = true;
+			}
+		}
+
+		if (!placed) {
+			return false;
+		}
+	}
+
+	// Everything fits. Move the pixels to their new places, from a copy of the pages
+	auto old_pages = pages;
+
+	for (int page = 0; page < static_cast<int>(pages.size()); page++) {
+		pages[page].allocator = allocators[page];
+		pages[page].dirty_rects = { { 0, 0, page_width, page_height } };
+	}
+
+	for (auto& [stream_id, stream] : streams) {
+		auto& [page, rect] = placements[stream_id];
+
+		copy_rect(old_pages, stream.page, stream.rect, page, rect);
+		stream.page = page;
+		stream.rect = rect;
+	}
+
+	extra_page = placements[-1].first;
+	extra_rect = placements[-1].second;
+	stats.num_repacks++;
+
+	return true;
+}
+
+void Texture_atlas::copy_rect(const std::vector<Page>& from_pages, int from_page, const Atlas_rect& from, int to_page, const Atlas_rect& to) {
+	auto& source = from_pages[from_page];
+	auto& destination = pages[to_page];
+
+	for (int row = 0; row < from.height; row++) {
+		std::memcpy(&destination.luma[static_cast<size_t>(to.y + row) * page_width + to.x],
+			&source.luma[static_cast<size_t>(from.y + row) * page_width + from.x], from.width);
+	}
+
+	// The chroma plane has half the rows, of the same number of bytes
+	for (int row = 0; row < from.height / 2; row++) {
+		std::memcpy(&destination.chroma[static_cast<size_t>(to.y / 2 + row) * page_width + to.x],
+			&source.chroma[static_cast<size_t>(from.y / 2 + row) * page_width + from.x], from.width);
+	}
+}
+
+bool Texture_atlas::update(int stream_id, const Decoded_frame& frame) {
+	auto it = streams.find(stream_id);
+
+	if (it == streams.end()) {
+		return false;
+	}
+
+	auto& stream = it->second;
+	auto& page = pages[stream.page];
+	auto& rect = stream.rect;
+	int width = std::min(stream.width, static_cast<int>(frame.width));
+	int height = std::min(stream.height, static_cast<int>(frame.height));
+	int chroma_bytes = std::min(align_even(width), static_cast<int>(frame.pitch));
+	auto luma_plane = frame.data.data();
+	auto chroma_plane = luma_plane + static_cast<size_t>(frame.pitch) * frame.height;
+
+	if (frame.data.size() < static_cast<size_t>(frame.pitch) * (frame.height + (frame.height + 1) / 2)) {
+		LOG_ERROR("Frame for stream %d is smaller than its size", stream_id);
+		return false;
+	}
+
+	for (int row = 0; row < height; row++) {
+		std::memcpy(&page.luma[static_cast<size_t>(rect.y + row) * page_width + rect.x], luma_plane + static_cast<size_t>(row) * frame.pitch, width);
+	}
+
+	for (int row = 0; row < (height + 1) / 2; row++) {
+		std::memcpy(&page.chroma[static_cast<size_t>(rect.y / 2 + row) * page_width + rect.x], chroma_plane + static_cast<size_t>(row) * frame.pitch, chroma_bytes);
+	}
+
+	page.dirty_rects.push_back(rect);
+
+	return true;
+}
+
+void Texture_atlas::upload_rect(int page, const Atlas_rect& rect) {
+	auto& luma = pages[page].luma;
+	auto& chroma = pages[page].chroma;
+
+	glBindTexture(GL_TEXTURE_2D_ARRAY, luma_texture);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, page_width);
+	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, rect.x, rect.y, page, rect.width, rect.height, 1, GL_RED, GL_UNSIGNED_BYTE,
+		&luma[static_cast<size_t>(rect.y) * page_width + rect.x]);
+
+	glBindTexture(GL_TEXTURE_2D_ARRAY, chroma_texture);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, page_width / 2);
+	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, rect.x / 2, rect.y / 2, page, rect.width / 2, rect.height / 2, 1, GL_RG, GL_UNSIGNED_BYTE,
+		&chroma[static_cast<size_t>(rect.y / 2) * page_width + rect.x]);
+
+	stats.num_upload_calls += 2;
+	stats.upload_bytes += static_cast<size_t>(rect.width) * rect.height * 3 / 2;
+}
+
+void Texture_atlas::upload() {
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	for (int page = 0; page < static_cast<int>(pages.size()); page++) {
+		auto& dirty_rects = pages[page].dirty_rects;
+
+		if (dirty_rects.empty()) {
+			continue;
+		}
+
+		// Merge only regions that are close in both directions, eg. neighbours on a shelf. Merging everything in a band
+		// of rows would also upload the streams in between that didn't change. A grown region is compared with the
+		// others again, and the whole pass is repeated until nothing merges
+		bool merged = true;
+
+		while (merged) {
+			merged = false;
+
+			for (size_t i = 0; i < dirty_rects.size(); i++) {
+				for (size_t j = i + 1; j < dirty_rects.size(); j++) {
+					auto& a = dirty_rects[i];
+					auto& b = dirty_rects[j];
+
+					if (b.x > a.x + a.width + merge_distance || a.x > b.x + b.width + merge_distance
+						|| b.y > a.y + a.height + merge_distance || a.y > b.y + b.height + merge_distance) {
+						continue;
+					}
+
+					int x_end = std::max(a.x + a.width, b.x + b.width);
+					int y_end = std::max(a.y + a.height, b.y + b.height);
+
+					a.x = std::min(a.x, b.x);
+					a.y = std::min(a.y, b.y);
+					a.width = x_end - a.x;
+					a.height = y_end - a.y;
+					dirty_rects.erase(dirty_rects.begin() + j);
+					j = i;
+					merged = true;
+				}
+			}
+		}
+
+		for (auto& rect : dirty_rects) {
+			upload_rect(page, rect);
+		}
+
+		dirty_rects.clear();
+	}
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+void Texture_atlas::draw(const std::vector<Atlas_instance>& instances) {
+	std::vector<float> instance_data;
+	int num_instances = 0;
+
+	instance_data.reserve(instances.size() * 9);
+
+	for (auto& instance : instances) {
+		auto it = streams.find(instance.stream_id);
+
+		if (it == streams.end()) {
+			continue;
+		}
+
+		auto& stream = it->second;
+		// Inset by a pixel, so filtering doesn't pick up neighbouring streams
+		float u = (stream.rect.x + 1.0f) / page_width;
+		float v = (stream.rect.y + 1.0f) / page_height;
+		float u_size = (stream.width - 2.0f) / page_width;
+		float v_size = (stream.height - 2.0f) / page_height;
+
+		instance_data.insert(instance_data.end(), {
+			instance.x, instance.y, instance.width, instance.height,
+			u, v, u_size, v_size,
+			static_cast<float>(stream.page)
+		});
+		num_instances++;
+	}
+
+	if (!num_instances) {
+		return;
+	}
+
+	glUseProgram(shader_program);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, luma_texture);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, chroma_texture);
+	glActiveTexture(GL_TEXTURE0);
+
+	// New storage each frame, so we don't wait for the previous draw to finish reading it
+	glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+	glBufferData(GL_ARRAY_BUFFER, instance_data.size() * sizeof(float), instance_data.data(), GL_STREAM_DRAW);
+
+	glBindVertexArray(vao);
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, num_instances);
+	glBindVertexArray(0);
+
+	stats.num_draw_calls++;
+}
+
+Atlas_stats Texture_atlas::get_stats() {
+	auto current_stats = stats;
+	stats = Atlas_stats();
+
+	return current_stats;
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <utility>
+#include <vector>
+
+class Decoded_frame;
+
+/**
+ * @brief A rectangle in an atlas page, in luma pixels
+*/
+struct Atlas_rect {
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+/**
+ * @brief Shelf packer for one atlas page. Rectangles are placed left to right on shelves,
+ * and a shelf is only used for rectangles of about its height. Freed space is reused, but
+ * the page fragments over time; Texture_atlas repacks all pages when an allocation fails
+*/
+class Rect_allocator {
+public:
+	Rect_allocator(int width, int height);
+
+	/**
+	 * @brief Finds space for a rectangle. The size is rounded up to even, so the chroma plane stays aligned
+	 * @param width Width in pixels
+	 * @param height Height in pixels
+	 * @param rect Filled by this function
+	 * @return True on success, false if there is no space
+	*/
+	bool allocate(int width, int height, Atlas_rect& rect);
+
+	/**
+	 * @brief Frees a rectangle from allocate
+	*/
+	void free(const Atlas_rect& rect);
+
+	/**
+	 * @brief Frees all rectangles
+	*/
+	void clear();
+private:
+	struct Shelf {
+		int y;
+		int height;
+		/**
+		 * @brief Used x ranges as (x, width), sorted on x
+		*/
+		std::vector<std::pair<int, int>> spans;
+	};
+
+	int width;
+	int height;
+	int shelves_end = 0;
+	std::vector<Shelf> shelves;
+};
+
+/**
+ * @brief Where to draw a stream, in normalized device coordinates
+*/
+struct Atlas_instance {
+	int stream_id;
+	float x;
+	float y;
+	float width;
+	float height;
+};
+
+/**
+ * @brief Counters since the last call to Texture_atlas::get_stats
+*/
+struct Atlas_stats {
+	int num_upload_calls = 0;
+	size_t upload_bytes = 0;
+	int num_draw_calls = 0;
+	int num_repacks = 0;
+};
+
+/**
+ * @brief Packs the NV12 frames of many small streams into a few large textures, so a video wall
+ * doesn't need a texture, an upload and a draw call per stream. The pages are layers of two texture
+ * arrays, one for luma and one for chroma. Frames are copied into a host copy of the pages, and the
+ * dirty regions are uploaded in batches, merging regions that are close together. All streams are
+ * drawn with one instanced draw call, with the UV rectangle and layer of each stream per instance.
+ * Needs a current OpenGL 4.3 context
+*/
+class Texture_atlas {
+public:
+	/**
+	 * @param page_width Width of each page in pixels
+	 * @param page_height Height of each page in pixels
+	 * @param num_pages Number of pages
+	*/
+	Texture_atlas(int page_width = 4096, int page_height = 4096, int num_pages = 4);
+	~Texture_atlas();
+
+	/**
+	 * @brief Creates the textures, buffers and shader program
+	 * @return True on success, false otherwise
+	*/
+	bool init();
+
+	/**
+	 * @brief Adds a stream. If the pages are too fragmented to fit it, all streams are repacked
+	 * @param width Frame width
+	 * @param height Frame height
+	 * @return Stream id, or -1 if it doesn't fit even after repacking
+	*/
+	int add_stream(int width, int height);
+
+	void remove_stream(int stream_id);
+
+	/**
+	 * @brief Changes the frame size of a stream, eg. after a sequence change
+	 * @return True on success, false if the new size doesn't fit. The stream keeps its old size then
+	*/
+	bool resize_stream(int stream_id, int width, int height);
+
+	/**
+	 * @brief Copies a frame of a stream into the host copy of its page. It's uploaded in the next call to upload
+	 * @param stream_id Id from add_stream
+	 * @param frame NV12 frame. Parts outside the size of the stream are cut off
+	 * @return True on success, false if the stream doesn't exist
+	*/
+	bool update(int stream_id, const Decoded_frame& frame);
+
+	/**
+	 * @brief Uploads all dirty regions
+	*/
+	void upload();
+
+	/**
+	 * @brief Draws the given streams with a single instanced draw call
+	*/
+	void draw(const std::vector<Atlas_instance>& instances);
+
+	Atlas_stats get_stats();
+private:
+	struct Stream {
+		int page;
+		Atlas_rect rect;
+		int width;
+		int height;
+	};
+
+	struct Page {
+		Rect_allocator allocator;
+		std::vector<unsigned char> luma;
+		std::vector<unsigned char> chroma;
+		std::vector<Atlas_rect> dirty_rects;
+	};
+
+	bool allocate(int width, int height, int& page, Atlas_rect& rect);
+	bool repack(int extra_width, int extra_height, int& extra_page, Atlas_rect& extra_rect);
+	void copy_rect(const std::vector<Page>& from_pages, int from_page, const Atlas_rect& from, int to_page, const Atlas_rect& to);
+	void upload_rect(int page, const Atlas_rect& rect);
+	int page_width;
+	int page_height;
+	std::vector<Page> pages;
+	std::map<int, Stream> streams;
+	int next_stream_id = 0;
+	unsigned int luma_texture = 0;
+	unsigned int chroma_texture = 0;
+	unsigned int shader_program = 0;
+	unsigned int vao = 0;
+	unsigned int instance_buffer = 0;
+	int memory_stream_id = -1;
+	size_t memory_reserved = 0;
+	Atlas_stats stats;
+};
@@ -1,14 +1,18 @@
 #include <functional>
 #include <vector>
 #include <map>
-#include <iostream>
+#include <sstream>
 #include <cstring>
 #include <filesystem>
+#include <mutex>
+#include <algorithm>
 
 #include <cuviddec.h>
 #include <nvcuvid.h>
 
 #include "decoder.h"
+#include "log.h"
+#include "memory_governor.h"
 #include "stream_info.h"
 
 /**
@@ -27,14 +31,77 @@ struct Video_format {
 	unsigned int height;
 };
 
-CUvideoparser video_parser;
-CUvideodecoder video_decoder = {};
-CUVIDDECODECAPS decode_capabilities = {};
-CUcontext cuda_context;
-CUdevice cuda_device;
-CUstream cuvid_stream;
+/**
+ * @brief Per-decoder state. The parser callbacks get a pointer to this as user data
+*/
+struct Decoder_context {
+	CUvideoparser video_parser = nullptr;
+	CUvideodecoder video_decoder = nullptr;
+	CUVIDDECODECAPS decode_capabilities = {};
+	CUstream cuvid_stream = nullptr;
+	/**
+	 * @brief The width and height are those of the display area, which is what the decoder outputs
+	*/
+	Video_format video_format = {};
+	/**
+	 * @brief Size the stream is coded at. Usually larger than the display area, eg. 1920x1088 for 1080p H.264
+	*/
+	unsigned int coded_width = 0;
+	unsigned int coded_height = 0;
+	/**
+	 * @brief Top left corner of the display area in the coded frame
+	*/
+	int display_left = 0;
+	int display_top = 0;
+	unsigned int max_width = 0;
+	unsigned int max_height = 0;
+	/**
+	 * @brief Surfaces of the current decoder, 0 if there is none yet. At least as many as the parser requested
+	*/
+	unsigned int num_decode_surfaces = 0;
+	/**
+	 * @brief False until the first sequence of the stream has been seen
+	*/
+	bool sequence_started = false;
+	/**
+	 * @brief Set while flushing a decoder whose remaining frames aren't wanted
+	*/
+	bool discard_frames = false;
+	/**
+	 * @brief Set by the parser callbacks when a picture can't be decoded, eg. because the GPU doesn't support
+	 * the stream, so Decoder::decode can report it. The parser itself doesn't return an error then
+	*/
+	bool decode_failed = false;
+	std::function<void(Decoded_frame&)> frame_callback;
+	std::function<void(const Frame_format&)> format_callback;
+	/**
+	 * @brief Reused for every frame passed to the frame callback, so we don't allocate per frame
+	*/
+	Decoded_frame decoded_frame;
+	/**
+	 * @brief Page-locked buffer, reused for every frame written to file
+	*/
+	unsigned char* host_frame = nullptr;
+	size_t host_frame_size = 0;
+	/**
+	 * @brief Stream registered for this decoder, and the stream its memory is currently reserved on. These
+	 * differ while the decoder is idle in a pool, see Decoder::set_memory_stream
+	*/
+	int own_memory_stream_id = -1;
+	int memory_stream_id = -1;
+	size_t surface_bytes = 0;
+	/**
+	 * @brief Reserved for the frame buffer the decoder currently holds. The page-locked buffer is host_frame_size
+	*/
+	size_t frame_buffer_bytes = 0;
+};
 
-Video_format video_format;
+const unsigned int num_output_surfaces = 1;
+
+// The CUDA context is shared by all decoders, so only the first decoder pays for creating it
+CUcontext cuda_context = nullptr;
+CUdevice cuda_device;
+std::mutex cuda_context_mutex;
 
 /**
  * @brief A collection of error codes from cuda.h, with a label so we can print
@@ -51,28 +118,63 @@ std::map<int, std::string> cuda_errors = {
 void print_device_info();
 
 /**
- * @brief Creates a decoder
- * @param video_format Video format
+ * @brief Initializes CUDA and creates the shared context, unless that's already done
+ * @return Cuda result code
+*/
+CUresult init_cuda();
+
+/**
+ * @brief Creates a decoder. The surface memory is reserved with the memory governor
+ * @param context Decoder context, with video format and max size set
+ * @param num_decode_surfaces Number of decode surfaces
  * @result Cuvid result code
 */
-CUresult create_decoder();
+CUresult create_decoder(Decoder_context* context, unsigned int num_decode_surfaces);
+
+/**
+ * @brief Destroys the decoder and releases its surface memory from the memory governor
+ * @param context Decoder context
+*/
+void destroy_decoder(Decoder_context* context);
+
+/**
+ * @brief Makes sure the reused frame buffers can hold a frame of the given size. Growing the
+ * buffers is reserved with the memory governor
+ * @param context Decoder context
+ * @param frame_size Size of a frame in bytes
+ * @return True on success, false if the memory budget doesn't allow it
+*/
+bool ensure_frame_buffer(Decoder_context* context, size_t frame_size);
+
+/**
+ * @brief Changes the coded size and display area of an existing decoder. Only works within the max size given
+ * when creating it. The surfaces are kept, so nothing is allocated
+ * @param context Decoder context, with the new video format, coded size and display area set
+ * @return Cuvid result code
+*/
+CUresult reconfigure_decoder(Decoder_context* context);
 
 /**
  * @brief Gets the decode capabilities. Useful if you look for specific decode features
- * @param video_format Video format
- * @param decode_capabilities Reference to decode capabilities result object
+ * @param context Decoder context. The capabilities are stored here
  * @return Cuvid result code
 */
-CUresult get_decode_cababilities(CUVIDDECODECAPS& decode_capabilities);
+CUresult get_decode_cababilities(Decoder_context* context);
 
 /**
  * @brief Initialize a video parser object
- * @param decoder The decoder calling this function
- * @param video_format Video format
- * @param video_parser Vide parser
+ * @param context Decoder context. Passed as user data to the parser callbacks
  * @return Cuvid result code
 */
-CUresult create_video_parser(Decoder* decoder);
+CUresult create_video_parser(Decoder_context* context);
+
+/**
+ * @brief Converts stream info to a video format
+ * @param stream_info Information about the stream
+ * @param video_format Out parameter, filled by this function
+ * @return True on success, false if there's no conversion (yet)
+*/
+bool make_video_format(const Stream_info& stream_info, Video_format& video_format);
 
 std::string get_video_codec_name(cudaVideoCodec codec_id) {
 	std::map<cudaVideoCodec, std::string> codecs = {
@@ -120,12 +222,11 @@ std::string get_chroma_format_name(cudaVideoChromaFormat chroma_format_id) {
 
 /**
  * @brief See definition at 433 in nvcuvid.h. There, it's called PFNVIDSEQUENCECALLBACK
- * @param user_data Should be a pointer to an instance of the Decoder class
+ * @param user_data Should be a pointer to the Decoder_context of the calling decoder
  * @param format Format structure, set by Nvidia
- * @return 
+ * @return Number of decode surfaces the parser may use, 0 if the stream can't be decoded
 */
 int sequence_callback_proc(void* user_data, CUVIDEOFORMAT* format) {
-	Decoder* decoder = static_cast<Decoder*>(user_data);
 	std::stringstream ss;
 
 	ss << "Video Input Information" << std::endl
@@ -139,8 +240,9 @@ int sequence_callback_proc(void* user_data, CUVIDEOFORMAT* format) {
 		<< "\tChroma       : " << get_chroma_format_name(format->chroma_format) << std::endl
 		<< "\tBit depth    : " << format->bit_depth_luma_minus8 + 8;
 
-	std::cout << ss.str() << std::endl;
+	LOG_INFO("%s", ss.str().c_str());
 
+	auto context = static_cast<Decoder_context*>(user_data);
 	CUVIDDECODECAPS decode_caps;
 	decode_caps.eCodecType = format->codec;
 	decode_caps.eChromaFormat = format->chroma_format;
@@ -157,28 +259,110 @@ int sequence_callback_proc(void* user_data, CUVIDEOFORMAT* format) {
 		{ "Macroblock (MBCount) not supported", (format->coded_width >> 4) * (format->coded_height >> 4) > decode_caps.nMaxMBCount}
 	};
 
+	// Returning 0 stops the parser from decoding the sequence
 	for (auto [msg, c] : error_conditions) {
 		if (c) {
-			std::cout << msg << std::endl;
-			return format->min_num_decode_surfaces;
+			LOG_ERROR("%s", msg.c_str());
+			context->decode_failed = true;
+			return 0;
+		}
+	}
+
+	auto& current_format = context->video_format;
+	Video_format video_format = {
+		format->codec,
+		format->chroma_format,
+		format->bit_depth_luma_minus8,
+		static_cast<unsigned int>(format->display_area.right - format->display_area.left),
+		static_cast<unsigned int>(format->display_area.bottom - format->display_area.top)
+	};
+	unsigned int num_decode_surfaces = format->min_num_decode_surfaces;
+	bool same_format = video_format.video_codec == current_format.video_codec
+		&& video_format.chroma_format == current_format.chroma_format
+		&& video_format.bit_depth_minus_8 == current_format.bit_depth_minus_8;
+	bool same_size = video_format.width == current_format.width && video_format.height == current_format.height;
+	bool same_layout = same_size && format->coded_width == context->coded_width && format->coded_height == context->coded_height
+		&& format->display_area.left == context->display_left && format->display_area.top == context->display_top;
+
+	// Growing the max size would change which streams the decoder can be reset for, eg. in a pool
+	if (format->coded_width > context->max_width || format->coded_height > context->max_height) {
+		LOG_ERROR("Stream is coded at %ux%u, larger than the max size %ux%u of the decoder", format->coded_width, format->coded_height,
+			context->max_width, context->max_height);
+		context->decode_failed = true;
+		return 0;
+	}
+
+	// The decoder is created here, when the parser knows how many surfaces the stream needs, unless it was
+	// created ahead of time. After that, only recreate if we must: more surfaces or another format.
+	// Extra surfaces are kept, so a prewarmed or pooled decoder isn't recreated
+	bool recreate = !context->video_decoder || !same_format || num_decode_surfaces > context->num_decode_surfaces;
+
+	current_format = video_format;
+	context->coded_width = format->coded_width;
+	context->coded_height = format->coded_height;
+	context->display_left = format->display_area.left;
+	context->display_top = format->display_area.top;
+
+	if (recreate) {
+		destroy_decoder(context);
+
+		auto ret = create_decoder(context, num_decode_surfaces);
+
+		if (ret != CUDA_SUCCESS) {
+			LOG_ERROR("Could not create decoder with %u surfaces. Error code was %d", num_decode_surfaces, ret);
+			context->decode_failed = true;
+			return 0;
+		}
+	}
+	else if (!same_layout) {
+		// The surfaces are kept, so an adaptive bitrate switch doesn't stall on allocations
+		auto ret = reconfigure_decoder(context);
+
+		if (ret != CUDA_SUCCESS) {
+			LOG_ERROR("Could not reconfigure decoder. Error code was %d", ret);
+			context->decode_failed = true;
+			return 0;
 		}
 	}
 
+	if (context->sequence_started && (!same_format || !same_size)) {
+		LOG_INFO("Stream changed to %ux%u, %u-bit. Decoder was %s", video_format.width, video_format.height,
+			video_format.bit_depth_minus_8 + 8, recreate ? "recreated" : "reconfigured in place");
+	}
+
+	context->sequence_started = true;
+
+	if ((!same_format || !same_size) && context->format_callback) {
+		context->format_callback({ video_format.width, video_format.height, video_format.bit_depth_minus_8 + 8 });
+	}
 
-	return format->min_num_decode_surfaces;
+	return context->num_decode_surfaces;
 }
 
 /**
  * @brief 
- * @param user_data Should be a pointer to an instance of the Decoder class
+ * @param user_data Should be a pointer to the Decoder_context of the calling decoder
  * @param params Parameter structure, set by Nvidia
  * @return 1 on success, 0 otherwise.
 */
 int decode_callback_proc(void* user_data, CUVIDPICPARAMS* params) {
+	auto context = static_cast<Decoder_context*>(user_data);
+
+	// No decoder if the sequence callback failed
+	if (!context->video_decoder) {
+		context->decode_failed = true;
+		return 0;
+	}
+
 	cuCtxPushCurrent(cuda_context);
-	cuvidDecodePicture(video_decoder, params);
+	auto ret = cuvidDecodePicture(context->video_decoder, params);
 	cuCtxPopCurrent(nullptr);
 
+	if (ret != CUDA_SUCCESS) {
+		context->decode_failed = true;
+		return 0;
+	}
+
 	// NB If we want zero-latency, we could call display_callback_proc directly.
 	//	Question: What are the disadvantages? Maybe frames are not displayed in the right order?
 
@@ -187,70 +371,126 @@ int decode_callback_proc(void* user_data, CUVIDPICPARAMS* params) {
 
 /**
  * @brief 
- * @param user_data Should be a pointer to an instance of the Decoder class
+ * @param user_data Should be a pointer to the Decoder_context of the calling decoder
  * @param display_info Display info structure, set by Nvidia
  * @return 
 */
 int display_callback_proc(void* user_data, CUVIDPARSERDISPINFO* display_info) {
+	auto context = static_cast<Decoder_context*>(user_data);
+
+	if (context->discard_frames) {
+		return 1;
+	}
+	auto& video_format = context->video_format;
 	CUdeviceptr source_frame_ptr = 0;
 	unsigned int source_pitch = 0;
 	CUVIDPROCPARAMS videoProcessingParameters = {};
-	unsigned char* host_pointer = nullptr;
 
 	videoProcessingParameters.progressive_frame = display_info->progressive_frame;
 	videoProcessingParameters.second_field = display_info->repeat_first_field + 1;
 	videoProcessingParameters.top_field_first = display_info->top_field_first;
 	videoProcessingParameters.unpaired_field = display_info->repeat_first_field < 0;
-	videoProcessingParameters.output_stream = cuvid_stream;
+	videoProcessingParameters.output_stream = context->cuvid_stream;
 
 	auto res = cuCtxPushCurrent(cuda_context);
 	
-	res = cuvidMapVideoFrame(video_decoder, display_info->picture_index, &source_frame_ptr,
+	res = cuvidMapVideoFrame(context->video_decoder, display_info->picture_index, &source_frame_ptr,
 		&source_pitch, &videoProcessingParameters);
 
 	CUVIDGETDECODESTATUS DecodeStatus;
 	memset(&DecodeStatus, 0, sizeof(DecodeStatus));
-	res = cuvidGetDecodeStatus(video_decoder, display_info->picture_index, &DecodeStatus);
+	res = cuvidGetDecodeStatus(context->video_decoder, display_info->picture_index, &DecodeStatus);
 
 	if (res == CUDA_SUCCESS && (DecodeStatus.decodeStatus == cuvidDecodeStatus_Error || DecodeStatus.decodeStatus == cuvidDecodeStatus_Error_Concealed))
 	{
 		//printf("Decode Error occurred for picture %d\n", m_nPicNumInDecodeOrder[display_info->picture_index]);
-		std::cout << "Decode error occured for picture with picture index (not in order) " << display_info->picture_index << std::endl;
-		cuvidUnmapVideoFrame(video_decoder, source_frame_ptr);
+		LOG_WARNING_LIMITED(10, "Decode error occured for picture with picture index (not in order) %d", display_info->picture_index);
+		cuvidUnmapVideoFrame(context->video_decoder, source_frame_ptr);
+		cuCtxPopCurrent(nullptr);
 		return 0;
 	}
 
-	uint8_t* decoded_frame = nullptr;
-
 	auto frame_size = (video_format.chroma_format == cudaVideoChromaFormat_444) ? source_pitch * (3 * video_format.height) :
 		source_pitch * (video_format.height + (video_format.height + 1) / 2);
-	// use CUDA based Device to Host memcpy
-	res = cuMemAllocHost((void**)&host_pointer, frame_size);
+
+	if (!ensure_frame_buffer(context, frame_size)) {
+		LOG_WARNING_LIMITED(1, "Dropping frame, no memory budget for frame buffer");
+		cuvidUnmapVideoFrame(context->video_decoder, source_frame_ptr);
+		cuCtxPopCurrent(nullptr);
+		return 0;
+	}
+
+	if (context->frame_callback) {
+		auto& decoded_frame = context->decoded_frame;
+
+		decoded_frame.data.resize(frame_size);
+		decoded_frame.width = video_format.width;
+		decoded_frame.height = video_format.height;
+		decoded_frame.pitch = source_pitch;
+		decoded_frame.timestamp = display_info->timestamp;
+
+		res = cuMemcpyDtoH(decoded_frame.data.data(), source_frame_ptr, frame_size);
+		cuvidUnmapVideoFrame(context->video_decoder, source_frame_ptr);
+		cuCtxPopCurrent(nullptr);
+
+		auto buffer = decoded_frame.data.data();
+		auto capacity = decoded_frame.data.capacity();
+
+		context->frame_callback(decoded_frame);
+
+		// The callback may have taken the buffer, and maybe given another one back. The taken buffer is no longer
+		// ours to account for, the one we got back is
+		if (decoded_frame.data.data() != buffer || decoded_frame.data.capacity() != capacity) {
+			auto& governor = Memory_governor::get();
+
+			governor.release(context->memory_stream_id, Memory_category::frame_pool, context->frame_buffer_bytes);
+			context->frame_buffer_bytes = decoded_frame.data.capacity();
+
+			if (context->frame_buffer_bytes > 0
+				&& !governor.reserve(context->memory_stream_id, Memory_category::frame_pool, context->frame_buffer_bytes)) {
+				std::vector<unsigned char>().swap(decoded_frame.data);
+				context->frame_buffer_bytes = 0;
+			}
+		}
+
+		return 1;
+	}
+
+	auto host_pointer = context->host_frame;
 
 	if (host_pointer)
 	{
+		// use CUDA based Device to Host memcpy
 		res = cuMemcpyDtoH(host_pointer, source_frame_ptr, frame_size);
 		std::filesystem::path full_path("c:\\temp\\yuv.yuv");
 		auto xx = full_path.parent_path();
-		auto yy = std::filesystem::is_directory(xx);
-		if (!yy) {
-			std::filesystem::create_directories(xx);
+		std::error_code ec;
+
+		// Backslashes are only separators on Windows. Elsewhere, the path has no parent
+		if (!xx.empty() && !std::filesystem::is_directory(xx, ec)) {
+			std::filesystem::create_directories(xx, ec);
 		}
 
 		FILE* fp = fopen(full_path.string().c_str(), "wb");
-		auto num_written = fwrite(host_pointer, 1, frame_size, fp);
-		fclose(fp);
 
-		res = cuvidUnmapVideoFrame(video_decoder, source_frame_ptr);
-		cuMemFreeHost(host_pointer);
+		if (fp) {
+			auto num_written = fwrite(host_pointer, 1, frame_size, fp);
+			fclose(fp);
+		}
+		else {
+			LOG_WARNING_LIMITED(1, "Could not open %s for writing", full_path.string().c_str());
+		}
 	}
 
+	cuvidUnmapVideoFrame(context->video_decoder, source_frame_ptr);
+	cuCtxPopCurrent(nullptr);
+
 	return 1;
 }
 
 /**
  * @brief More info on Supplemental Enhancement Information: https://www.magewell.com/blog/82/detail
- * @param user_data Should be a pointer to an instance of the Decoder class
+ * @param user_data Should be a pointer to the Decoder_context of the calling decoder
  * @param message_info Message info structure, set by Nvidia
  * @return 
 */
@@ -259,10 +499,36 @@ int get_sei_callback_proc(void* user_data, CUVIDSEIMESSAGEINFO* message_info) {
 }
 
 Decoder::~Decoder() {
-	cuvidDestroyVideoParser(video_parser);
+	if (!context) {
+		return;
+	}
+
+	if (context->video_parser) {
+		cuvidDestroyVideoParser(context->video_parser);
+	}
+
+	// Unregistering our own stream releases whatever is left, so take back what a pool holds for us
+	set_memory_stream(-1);
+	destroy_decoder(context);
+
+	cuCtxPushCurrent(cuda_context);
+
+	if (context->cuvid_stream) {
+		cuStreamDestroy(context->cuvid_stream);
+	}
+
+	if (context->host_frame) {
+		cuMemFreeHost(context->host_frame);
+	}
+
+	cuCtxPopCurrent(nullptr);
+
+	Memory_governor::get().unregister_stream(context->own_memory_stream_id);
+
+	delete context;
 }
 
-bool Decoder::init(const Stream_info& stream_info) {
+bool make_video_format(const Stream_info& stream_info, Video_format& video_format) {
 	// More conversions can be found in function FFmpeg2NvCodecId here: https://github.com/NVIDIA/video-sdk-samples/blob/master/Samples/Utils/FFmpegDemuxer.h
 	std::map<Codec_id, cudaVideoCodec> codec_map = {
 		{Codec_id::h264, cudaVideoCodec::cudaVideoCodec_H264},
@@ -274,12 +540,12 @@ bool Decoder::init(const Stream_info& stream_info) {
 	};
 
 	if (codec_map.count(stream_info.codec_id) == 0) {
-		std::cout << "Don't have a codec corresponding to codec_id " << static_cast<int>(stream_info.codec_id) << " (yet)" << std::endl;
+		LOG_ERROR("Don't have a codec corresponding to codec_id %d (yet)", static_cast<int>(stream_info.codec_id));
 		return false;
 	}
 
 	if (pixel_format_map.count(stream_info.pixel_format) == 0) {
-		std::cout << "Don't have a chroma format corresponding to pixel_format " << static_cast<int>(stream_info.pixel_format) << " (yet)" << std::endl;
+		LOG_ERROR("Don't have a chroma format corresponding to pixel_format %d (yet)", static_cast<int>(stream_info.pixel_format));
 		return false;
 	}
 
@@ -291,9 +557,109 @@ bool Decoder::init(const Stream_info& stream_info) {
 		stream_info.height
 	};
 
+	return true;
+}
+
+bool Decoder::init(const Stream_info& stream_info, unsigned int max_width, unsigned int max_height, unsigned int num_decode_surfaces) {
+	Video_format video_format;
+
+	if (context) {
+		LOG_ERROR("Decoder is already initialized");
+		return false;
+	}
+
+	if (!make_video_format(stream_info, video_format)) {
+		return false;
+	}
+
+	context = new Decoder_context();
+	context->video_format = video_format;
+	// Until the first sequence header says otherwise, assume the size is rounded up to whole macroblocks
+	context->coded_width = (video_format.width + 15) & ~15u;
+	context->coded_height = (video_format.height + 15) & ~15u;
+	context->max_width = std::max(max_width, context->coded_width);
+	context->max_height = std::max(max_height, context->coded_height);
+	context->own_memory_stream_id = Memory_governor::get().register_stream("decoder " + get_video_codec_name(video_format.video_codec)
+		+ " " + std::to_string(video_format.width) + "x" + std::to_string(video_format.height));
+	context->memory_stream_id = context->own_memory_stream_id;
+
 	typedef std::function<int()> decoder_fn;
 	typedef std::pair<std::string, decoder_fn> fn_with_label;
 
+	std::vector<fn_with_label> fns = {
+		{"Initializing CUDA",				[]() { return init_cuda(); }},
+		{"Creating video parser",			[this]() { return create_video_parser(context); }},
+		{"Getting decoder capabilities",	[this]() { return get_decode_cababilities(context); }}
+	};
+
+	if (num_decode_surfaces > 0) {
+		fns.push_back({"Creating decoder",	[this, num_decode_surfaces]() { return create_decoder(context, num_decode_surfaces); }});
+	}
+
+	for (auto& [the_label, the_function] : fns) {
+		auto ret = the_function();
+		if (ret != CUDA_SUCCESS) {
+			LOG_ERROR("%s failed. Error code was %d (%s)", the_label.c_str(), ret, cuda_errors.count(ret) > 0 ? cuda_errors[ret].c_str() : "see cudaError_enum");
+			return false;
+		}
+		else {
+			// TODO: Not the best code; this will be removed soon but needed to find out how to get setup to work!
+			LOG_DEBUG("%s: SUCCESS", the_label.c_str());
+		}
+	}
+
+	cuCtxPushCurrent(cuda_context);
+	cuStreamCreate(&context->cuvid_stream, CU_STREAM_DEFAULT);
+	cuCtxPopCurrent(nullptr);
+
+	return true;
+}
+
+bool Decoder::reset(const Stream_info& stream_info) {
+	Video_format video_format;
+
+	if (!context || !make_video_format(stream_info, video_format)) {
+		return false;
+	}
+
+	auto& current_format = context->video_format;
+
+	if (video_format.video_codec != current_format.video_codec
+		|| video_format.chroma_format != current_format.chroma_format
+		|| video_format.bit_depth_minus_8 != current_format.bit_depth_minus_8
+		|| video_format.width > context->max_width
+		|| video_format.height > context->max_height) {
+		return false;
+	}
+
+	// The parser is cheap to create, and starting with a new one guarantees no state is left from the previous stream
+	if (context->video_parser) {
+		cuvidDestroyVideoParser(context->video_parser);
+		context->video_parser = nullptr;
+	}
+
+	if (create_video_parser(context) != CUDA_SUCCESS) {
+		LOG_ERROR("Could not create video parser");
+		return false;
+	}
+
+	// The decoder keeps its current size. The first sequence header of the new stream gives the coded size
+	// and display area, and the decoder is reconfigured then if they differ
+	context->sequence_started = false;
+
+	return true;
+}
+
+CUresult init_cuda() {
+	std::lock_guard<std::mutex> lock(cuda_context_mutex);
+
+	if (cuda_context) {
+		return CUDA_SUCCESS;
+	}
+
+	typedef std::function<int()> cuda_fn;
+	typedef std::pair<std::string, cuda_fn> fn_with_label;
+
 	// Use cuDevicePrimaryCtxRetain over cuCtxCreate()! See here https://docs.nvidia.com/cuda/cuda-driver-api/group__CUDA__CTX.html#group__CUDA__CTX_1g65dc0012348bc84810e2103a40d8e2cf
 	// We can set flags using cuDevicePrimaryCtxSetFlags
 	unsigned int api_version;
@@ -304,32 +670,25 @@ bool Decoder::init(const Stream_info& stream_info) {
 	// TODO: Add cuDeviceGetCount?
 	std::vector<fn_with_label> fns = {
 		{"Initializing CUDA",				[]() { return cuInit(0); }},
-		{"Printing device info",			[this]() { print_device_info(); return CUDA_SUCCESS; }},
+		{"Printing device info",			[]() { print_device_info(); return CUDA_SUCCESS; }},
 		{"Getting device",					[]() { return cuDeviceGet(&cuda_device, 0); }},
 		//{"Getting device context",			[&cuda_context, &cuda_device]() { return cuDevicePrimaryCtxRetain(&cuda_context, cuda_device); }},
 		{"Getting device context",			[&context_flags]() { return cuCtxCreate_v2(&cuda_context, context_flags, cuda_device); }},
 		{"Getting API version",				[&api_version]() { return cuCtxGetApiVersion(cuda_context, &api_version); }},
-		{"Printing API version",			[&api_version]() { std::cout << "API version: " << api_version << std::endl; return CUDA_SUCCESS; }},
-		{"Creating video parser",			[this]() { return create_video_parser(this); }},
-		{"Getting decoder capabilities",	[this]() { return get_decode_cababilities(decode_capabilities); }},
-		{"Creating decoder",				[this]() { return create_decoder(); }}
+		{"Printing API version",			[&api_version]() { LOG_INFO("API version: %u", api_version); return CUDA_SUCCESS; }},
+		// cuCtxCreate makes the context current. We push it when needed instead, since decoders are used from several threads
+		{"Releasing device context",		[]() { return cuCtxPopCurrent(nullptr); }}
 	};
 
 	for (auto& [the_label, the_function] : fns) {
 		auto ret = the_function();
 		if (ret != CUDA_SUCCESS) {
-			std::cout << the_label << " failed. Error code was " << ret << " (" << (cuda_errors.count(ret) > 0 ? cuda_errors[ret] : "see cudaError_enum") << ")" << std::endl;
-			return false;
-		}
-		else {
-			// TODO: Not the best code; this will be removed soon but needed to find out how to get setup to work!
-			std::cout << the_label << ": SUCCESS" << std::endl;
+			LOG_ERROR("%s failed. Error code was %d (%s)", the_label.c_str(), ret, cuda_errors.count(ret) > 0 ? cuda_errors[ret].c_str() : "see cudaError_enum");
+			return ret;
 		}
 	}
 
-	cuStreamCreate(&cuvid_stream, CU_STREAM_DEFAULT);
-
-	return true;
+	return CUDA_SUCCESS;
 }
 
 void print_device_info() {
@@ -343,84 +702,250 @@ void print_device_info() {
 	for (int idx_device = 0; idx_device < device_count; idx_device++) {
 		res = cuDeviceGet(&cuda_device, idx_device);
 		cuDeviceGetName(device_name, max_name_length, cuda_device);
-		std::cout << "Device name: " << device_name << std::endl;
+		LOG_INFO("Device name: %s", device_name);
 	}
 }
 
-CUresult create_video_parser(Decoder* decoder) {
+CUresult create_video_parser(Decoder_context* context) {
 	CUVIDPARSERPARAMS params = {};
 
-	params.CodecType = video_format.video_codec;
+	params.CodecType = context->video_format.video_codec;
 	params.ulMaxNumDecodeSurfaces = 1; // This is a dummy value. The actual value is received in pfnSequenceCallback
 	params.ulMaxDisplayDelay = 0;
-	params.pUserData = decoder;
+	params.pUserData = context;
 	params.pfnSequenceCallback = sequence_callback_proc;
 	params.pfnDecodePicture = decode_callback_proc;
 	params.pfnDisplayPicture = display_callback_proc;
 	params.pfnGetSEIMsg = get_sei_callback_proc;
 
-	return cuvidCreateVideoParser(&video_parser, &params);
+	return cuvidCreateVideoParser(&context->video_parser, &params);
 }
 
-CUresult get_decode_cababilities(CUVIDDECODECAPS& decode_capabilities) {
+CUresult get_decode_cababilities(Decoder_context* context) {
+	auto& video_format = context->video_format;
+	auto& decode_capabilities = context->decode_capabilities;
+
 	decode_capabilities.eCodecType = video_format.video_codec;
 	decode_capabilities.eChromaFormat = video_format.chroma_format;
 	decode_capabilities.nBitDepthMinus8 = video_format.bit_depth_minus_8;
 
+	cuCtxPushCurrent(cuda_context);
 	auto ret = cuvidGetDecoderCaps(&decode_capabilities);
+	cuCtxPopCurrent(nullptr);
 
 	if (ret == CUDA_SUCCESS) {
 		if (!decode_capabilities.bIsSupported) {
-			std::cout << "Codec not supported" << std::endl;
+			LOG_ERROR("Codec not supported");
 		}
-		if ((video_format.width > decode_capabilities.nMaxWidth)
-			|| (video_format.height > decode_capabilities.nMaxHeight)) {
-			std::cout << "Resolution not supported" << std::endl;
+		if ((context->max_width > decode_capabilities.nMaxWidth)
+			|| (context->max_height > decode_capabilities.nMaxHeight)) {
+			LOG_ERROR("Resolution not supported");
 		}
 		if ((video_format.width >> 4) * (video_format.height >> 4) > decode_capabilities.nMaxMBCount) {
-			std::cout << "MBCount not supported" << std::endl;
+			LOG_ERROR("MBCount not supported");
 		}
 	}
 
 	return ret;
 }
 
-CUresult create_decoder() {
+CUresult create_decoder(Decoder_context* context, unsigned int num_decode_surfaces) {
+	auto& video_format = context->video_format;
 	CUVIDDECODECREATEINFO create_info = {};
+	// Surfaces are allocated for the max size. Decode surfaces have the chroma format of the stream, with 16 bits per
+	// sample for more than 8 bits. Monochrome is decoded as 4:2:0. Output surfaces are NV12, see OutputFormat below
+	size_t num_pixels = static_cast<size_t>(context->max_width) * context->max_height;
+	size_t bytes_per_sample = video_format.bit_depth_minus_8 > 0 ? 2 : 1;
+	size_t bytes_per_decode_surface = video_format.chroma_format == cudaVideoChromaFormat_444 ? num_pixels * 3 * bytes_per_sample :
+		video_format.chroma_format == cudaVideoChromaFormat_422 ? num_pixels * 2 * bytes_per_sample : num_pixels * 3 / 2 * bytes_per_sample;
+	size_t bytes_per_output_surface = num_pixels * 3 / 2;
+	size_t surface_bytes = bytes_per_decode_surface * num_decode_surfaces + bytes_per_output_surface * num_output_surfaces;
+
+	if (!Memory_governor::get().reserve(context->memory_stream_id, Memory_category::decoder_surfaces, surface_bytes)) {
+		return CUDA_ERROR_OUT_OF_MEMORY;
+	}
 
 	create_info.bitDepthMinus8 = video_format.bit_depth_minus_8;
 	create_info.ChromaFormat = video_format.chroma_format;
 	create_info.CodecType = video_format.video_codec;
-	create_info.ulWidth = video_format.width;
-	create_info.ulHeight = video_format.height;
-	// Set the max size to another value if we want to support video that change size
-	create_info.ulMaxWidth = video_format.width;
-	create_info.ulMaxHeight = video_format.height;
+	create_info.ulWidth = context->coded_width;
+	create_info.ulHeight = context->coded_height;
+	// Decoders can be reset to any size up to this, see reconfigure_decoder
+	create_info.ulMaxWidth = context->max_width;
+	create_info.ulMaxHeight = context->max_height;
+	// Only the display area is output, at its own size
+	create_info.display_area.left = static_cast<short>(context->display_left);
+	create_info.display_area.top = static_cast<short>(context->display_top);
+	create_info.display_area.right = static_cast<short>(context->display_left + video_format.width);
+	create_info.display_area.bottom = static_cast<short>(context->display_top + video_format.height);
 	create_info.ulTargetWidth = video_format.width;
 	create_info.ulTargetHeight = video_format.height;
-	// TODO: This value  can be set manually, but should atleast be CUVIDEOFORMAT::min_num_decode_surfaces. See documentation
-	create_info.ulNumDecodeSurfaces = 10;
-	create_info.ulNumOutputSurfaces = 1;
+	create_info.ulNumDecodeSurfaces = num_decode_surfaces;
+	create_info.ulNumOutputSurfaces = num_output_surfaces;
 	// TODO: Not sure if this is correct, but it will render CUDA_ERROR_NOT_SUPPORTED if it's wrong
 	//	so fine to use it for now!
 	create_info.OutputFormat = cudaVideoSurfaceFormat::cudaVideoSurfaceFormat_NV12;
 	create_info.DeinterlaceMode = cudaVideoDeinterlaceMode_enum::cudaVideoDeinterlaceMode_Adaptive;
 
-	return cuvidCreateDecoder(&video_decoder, &create_info);
+	cuCtxPushCurrent(cuda_context);
+	auto ret = cuvidCreateDecoder(&context->video_decoder, &create_info);
+	cuCtxPopCurrent(nullptr);
+
+	if (ret != CUDA_SUCCESS) {
+		Memory_governor::get().release(context->memory_stream_id, Memory_category::decoder_surfaces, surface_bytes);
+		context->video_decoder = nullptr;
+		return ret;
+	}
+
+	context->num_decode_surfaces = num_decode_surfaces;
+	context->surface_bytes = surface_bytes;
+
+	return ret;
 }
 
-bool Decoder::decode(unsigned char* data, int data_size) {
+void destroy_decoder(Decoder_context* context) {
+	if (!context->video_decoder) {
+		return;
+	}
+
+	cuCtxPushCurrent(cuda_context);
+	cuvidDestroyDecoder(context->video_decoder);
+	cuCtxPopCurrent(nullptr);
+
+	Memory_governor::get().release(context->memory_stream_id, Memory_category::decoder_surfaces, context->surface_bytes);
+	context->video_decoder = nullptr;
+	context->num_decode_surfaces = 0;
+	context->surface_bytes = 0;
+}
+
+bool ensure_frame_buffer(Decoder_context* context, size_t frame_size) {
+	auto& governor = Memory_governor::get();
+
+	if (context->frame_callback) {
+		if (context->frame_buffer_bytes < frame_size) {
+			if (!governor.reserve(context->memory_stream_id, Memory_category::frame_pool, frame_size - context->frame_buffer_bytes)) {
+				return false;
+			}
+
+			context->decoded_frame.data.reserve(frame_size);
+			context->frame_buffer_bytes = frame_size;
+		}
+
+		return true;
+	}
+
+	if (context->host_frame_size < frame_size) {
+		if (!governor.reserve(context->memory_stream_id, Memory_category::frame_pool, frame_size)) {
+			return false;
+		}
+
+		if (context->host_frame) {
+			cuMemFreeHost(context->host_frame);
+			governor.release(context->memory_stream_id, Memory_category::frame_pool, context->host_frame_size);
+		}
+
+		context->host_frame = nullptr;
+		context->host_frame_size = 0;
+
+		if (cuMemAllocHost((void**)&context->host_frame, frame_size) != CUDA_SUCCESS) {
+			governor.release(context->memory_stream_id, Memory_category::frame_pool, frame_size);
+			context->host_frame = nullptr;
+			return false;
+		}
+
+		context->host_frame_size = frame_size;
+	}
+
+	return true;
+}
+
+CUresult reconfigure_decoder(Decoder_context* context) {
+	auto& video_format = context->video_format;
+	CUVIDRECONFIGUREDECODERINFO reconfigure_info = {};
+
+	reconfigure_info.ulWidth = context->coded_width;
+	reconfigure_info.ulHeight = context->coded_height;
+	reconfigure_info.ulTargetWidth = video_format.width;
+	reconfigure_info.ulTargetHeight = video_format.height;
+	reconfigure_info.ulNumDecodeSurfaces = context->num_decode_surfaces;
+	reconfigure_info.display_area.left = static_cast<short>(context->display_left);
+	reconfigure_info.display_area.top = static_cast<short>(context->display_top);
+	reconfigure_info.display_area.right = static_cast<short>(context->display_left + video_format.width);
+	reconfigure_info.display_area.bottom = static_cast<short>(context->display_top + video_format.height);
+
+	cuCtxPushCurrent(cuda_context);
+	auto ret = cuvidReconfigureDecoder(context->video_decoder, &reconfigure_info);
+	cuCtxPopCurrent(nullptr);
+
+	return ret;
+}
+
+bool Decoder::decode(unsigned char* data, int data_size, long long timestamp) {
 	CUVIDSOURCEDATAPACKET data_packet = {};
 
 	data_packet.payload = data;
 	data_packet.payload_size = data_size;
+	data_packet.flags = CUVID_PKT_TIMESTAMP;
+	data_packet.timestamp = timestamp;
+	context->decode_failed = false;
+
+	auto ret = cuvidParseVideoData(context->video_parser, &data_packet);
+
+	if (ret != CUDA_SUCCESS) {
+		LOG_WARNING_LIMITED(10, "Could not parse packet");
+		return false;
+	}
+
+	if (context->decode_failed) {
+		LOG_WARNING_LIMITED(10, "Could not decode packet");
+		return false;
+	}
+
+	return true;
+}
 
-	auto ret = cuvidParseVideoData(video_parser, &data_packet);
+bool Decoder::flush(bool discard_frames) {
+	CUVIDSOURCEDATAPACKET data_packet = {};
+
+	data_packet.flags = CUVID_PKT_ENDOFSTREAM;
+
+	// The display callback is called from within cuvidParseVideoData, so this only affects this flush
+	context->discard_frames = discard_frames;
+
+	auto ret = cuvidParseVideoData(context->video_parser, &data_packet);
+
+	context->discard_frames = false;
 
 	if (ret != CUDA_SUCCESS) {
-		std::cout << "Could not parse packet" << std::endl;
+		LOG_WARNING("Could not flush parser");
 		return false;
 	}
 
 	return true;
 }
+
+void Decoder::set_frame_callback(std::function<void(Decoded_frame&)> frame_callback) {
+	context->frame_callback = frame_callback;
+}
+
+void Decoder::set_format_callback(std::function<void(const Frame_format&)> format_callback) {
+	context->format_callback = format_callback;
+}
+
+void Decoder::set_memory_stream(int stream_id) {
+	if (!context) {
+		return;
+	}
+
+	auto& governor = Memory_governor::get();
+	auto new_stream_id = stream_id >= 0 ? stream_id : context->own_memory_stream_id;
+
+	governor.transfer(context->memory_stream_id, new_stream_id, Memory_category::decoder_surfaces, context->surface_bytes);
+	governor.transfer(context->memory_stream_id, new_stream_id, Memory_category::frame_pool,
+		context->frame_buffer_bytes + context->host_frame_size);
+	context->memory_stream_id = new_stream_id;
+}
+
+size_t Decoder::get_memory_usage() {
+	return context ? context->surface_bytes + context->frame_buffer_bytes + context->host_frame_size : 0;
+}
\ No newline at end of file
@@ -1,7 +1,34 @@
 #pragma once
 
+#include <functional>
+#include <vector>
+
 struct Video_format;
 struct Stream_info;
+struct Decoder_context;
+
+/**
+ * @brief A decoded frame, copied to host memory. The layout is NV12: a luma plane
+ * of pitch * height bytes followed by the interleaved chroma plane
+*/
+class Decoded_frame {
+public:
+	std::vector<unsigned char> data;
+	unsigned int width;
+	unsigned int height;
+	unsigned int pitch;
+	long long timestamp;
+};
+
+/**
+ * @brief Format of the decoded frames
+*/
+class Frame_format {
+public:
+	unsigned int width;
+	unsigned int height;
+	unsigned int bit_depth;
+};
 
 /**
  * @brief See guide for NV12 decoding here: https://docs.nvidia.com/video-codec-sdk/nvdec-video-decoder-api-prog-guide/index.html
@@ -10,20 +37,74 @@ class Decoder {
 public:
 	Decoder() {}
 	~Decoder();
+	// The context is owned, so a copy would destroy the same decoder twice
+	Decoder(const Decoder&) = delete;
+	Decoder& operator=(const Decoder&) = delete;
 
 	/**
 	 * @brief Initializes cuvid decoding for a file with the given format
 	 * @param stream_info Information about the stream
+	 * @param max_width Largest coded width this decoder can be reset or switch to mid-stream. 0 means the width of the
+	 * stream. Decoding fails on a sequence header with a larger size; the decoder isn't grown
+	 * @param max_height Largest coded height this decoder can be reset or switch to mid-stream. 0 means the height of the stream
+	 * @param num_decode_surfaces Creates the decoder now, with this many surfaces. 0 means the decoder is created
+	 * when the first sequence header is parsed, with as many surfaces as the stream needs
 	 * @return True on success, false otherwise
 	*/
-	bool init(const Stream_info& stream_info);
+	bool init(const Stream_info& stream_info, unsigned int max_width = 0, unsigned int max_height = 0, unsigned int num_decode_surfaces = 0);
+
+	/**
+	 * @brief Prepares an initialized decoder for a new stream, without recreating the decoder.
+	 * The stream must have the same codec, chroma format and bit depth as the one used in init,
+	 * and fit within the max size
+	 * @param stream_info Information about the new stream
+	 * @return True on success, false otherwise
+	*/
+	bool reset(const Stream_info& stream_info);
 
 	/**
 	 * @brief Tries to decode the given data
 	 * @param data Data pointer
 	 * @param data_size Size of data
+	 * @param timestamp Presentation timestamp, passed on to the decoded frame
+	 * @return True on success, false if the data could not be parsed or decoded, eg. when the GPU doesn't support the stream
+	*/
+	bool decode(unsigned char* data, int data_size, long long timestamp = 0);
+
+	/**
+	 * @brief Signals end of stream, so frames still held by the parser are output
+	 * @param discard_frames True to drop the remaining frames instead, eg. when the decoder goes back to a pool
 	 * @return True on success, false otherwise
 	*/
-	bool decode(unsigned char* data, int data_size);
+	bool flush(bool discard_frames = false);
+
+	/**
+	 * @brief Sets a function that is called for each decoded frame. If no function is
+	 * set, frames are written to file. The function may move the frame data out to keep
+	 * it; otherwise the buffer is reused for the next frame
+	 * @param frame_callback Function to call, from the thread calling decode or flush
+	*/
+	void set_frame_callback(std::function<void(Decoded_frame&)> frame_callback);
+
+	/**
+	 * @brief Sets a function that is called when the stream changes format, eg. on an adaptive bitrate
+	 * switch. It's called before the first frame in the new format, so downstream buffers and textures
+	 * can be resized in time
+	 * @param format_callback Function to call, from the thread calling decode or flush
+	*/
+	void set_format_callback(std::function<void(const Frame_format&)> format_callback);
+
+	/**
+	 * @brief Moves the memory reserved by this decoder to another memory governor stream, and reserves there from now
+	 * on. Used by Decoder_pool, so idle decoders count as the pool's memory
+	 * @param stream_id Stream to reserve on, or -1 for the decoder's own stream
+	*/
+	void set_memory_stream(int stream_id);
+
+	/**
+	 * @brief Memory reserved by this decoder with the memory governor, for surfaces and frame buffers
+	*/
+	size_t get_memory_usage();
 private:
-};
\ No newline at end of file
+	Decoder_context* context = nullptr;
+};
@@ -0,0 +1,177 @@
+#include <tuple>
+
+#include "decoder.h"
+#include "decoder_pool.h"
+#include "log.h"
+#include "memory_governor.h"
+
+/**
+ * @brief Surfaces of prewarmed decoders. Enough for most streams; a stream that needs more recreates its decoder
+*/
+const unsigned int prewarm_num_decode_surfaces = 10;
+
+bool Decoder_key::operator<(const Decoder_key& other) const {
+	return std::tie(codec_id, pixel_format, bits_per_raw_pixel, max_width, max_height)
+		< std::tie(other.codec_id, other.pixel_format, other.bits_per_raw_pixel, other.max_width, other.max_height);
+}
+
+Decoder_pool::Decoder_pool(unsigned int max_width, unsigned int max_height) : max_width(max_width), max_height(max_height) {
+	memory_stream_id = Memory_governor::get().register_stream("decoder pool (idle)", [this](size_t bytes_needed) { return shrink(bytes_needed); });
+}
+
+Decoder_pool::~Decoder_pool() {
+	// Before the idle decoders are destroyed, so shrink is no longer called
+	Memory_governor::get().unregister_stream(memory_stream_id);
+}
+
+Decoder_key Decoder_pool::make_key(const Stream_info& stream_info) {
+	bool fits = (stream_info.width <= max_width) && (stream_info.height <= max_height);
+
+	return {
+		stream_info.codec_id,
+		stream_info.pixel_format,
+		stream_info.bits_per_raw_pixel,
+		fits ? max_width : stream_info.width,
+		fits ? max_height : stream_info.height
+	};
+}
+
+std::unique_ptr<Decoder> Decoder_pool::create_decoder(const Stream_info& stream_info, const Decoder_key& key, unsigned int num_decode_surfaces) {
+	auto decoder = std::make_unique<Decoder>();
+
+	if (!decoder->init(stream_info, key.max_width, key.max_height, num_decode_surfaces)) {
+		return nullptr;
+	}
+
+	return decoder;
+}
+
+bool Decoder_pool::prewarm(const Stream_info& stream_info, int count) {
+	auto key = make_key(stream_info);
+	int num_missing;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		num_missing = count - static_cast<int>(idle_decoders[key].size());
+	}
+
+	// Create outside the lock, since this is the slow part
+	for (int i = 0; i < num_missing; i++) {
+		// Create the decoder now, so the first acquire doesn't wait for it
+		auto decoder = create_decoder(stream_info, key, prewarm_num_decode_surfaces);
+
+		if (!decoder) {
+			return false;
+		}
+
+		decoder->set_memory_stream(memory_stream_id);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		idle_decoders[key].push_back(std::move(decoder));
+	}
+
+	return true;
+}
+
+std::unique_ptr<Decoder> Decoder_pool::acquire(const Stream_info& stream_info) {
+	auto key = make_key(stream_info);
+	std::unique_ptr<Decoder> decoder;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto& decoders = idle_decoders[key];
+
+		if (!decoders.empty()) {
+			decoder = std::move(decoders.back());
+			decoders.pop_back();
+		}
+	}
+
+	// In use, the decoder's memory counts as its own again
+	if (decoder) {
+		decoder->set_memory_stream(-1);
+	}
+
+	if (decoder && !decoder->reset(stream_info)) {
+		LOG_WARNING("Could not reset pooled decoder, creating a new one");
+		decoder.reset();
+	}
+
+	if (!decoder) {
+		decoder = create_decoder(stream_info, key, 0);
+	}
+
+	if (decoder) {
+		std::lock_guard<std::mutex> lock(mutex);
+		acquired_decoders[decoder.get()] = key;
+	}
+
+	return decoder;
+}
+
+void Decoder_pool::release(std::unique_ptr<Decoder> decoder) {
+	if (!decoder) {
+		return;
+	}
+
+	Decoder_key key;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = acquired_decoders.find(decoder.get());
+
+		if (it == acquired_decoders.end()) {
+			LOG_ERROR("Released decoder was not acquired from this pool");
+			return;
+		}
+
+		key = it->second;
+		acquired_decoders.erase(it);
+	}
+
+	decoder->set_frame_callback(nullptr);
+	decoder->set_format_callback(nullptr);
+	decoder->flush(true);
+	// Idle decoders are reserved on the pool's stream, so they're what the governor asks the pool to shrink
+	decoder->set_memory_stream(memory_stream_id);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	idle_decoders[key].push_back(std::move(decoder));
+}
+
+size_t Decoder_pool::shrink(size_t bytes_needed) {
+	std::vector<std::unique_ptr<Decoder>> evicted_decoders;
+	size_t bytes_freed = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		for (auto& [key, decoders] : idle_decoders) {
+			while (!decoders.empty() && bytes_freed < bytes_needed) {
+				bytes_freed += decoders.back()->get_memory_usage();
+				evicted_decoders.push_back(std::move(decoders.back()));
+				decoders.pop_back();
+			}
+		}
+	}
+
+	if (!evicted_decoders.empty()) {
+		LOG_INFO("Evicting %zu idle decoders to free memory", evicted_decoders.size());
+	}
+
+	// Decoders release their memory from the governor when destroyed, outside the lock
+	evicted_decoders.clear();
+
+	return bytes_freed;
+}
+
+size_t Decoder_pool::size() {
+	std::lock_guard<std::mutex> lock(mutex);
+	size_t num_decoders = 0;
+
+	for (auto& [key, decoders] : idle_decoders) {
+		num_decoders += decoders.size();
+	}
+
+	return num_decoders;
+}
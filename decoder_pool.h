@@ -0,0 +1,77 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "stream_info.h"
+
+class Decoder;
+
+/**
+ * @brief Decoders can only be reused for streams that match on all of these
+*/
+struct Decoder_key {
+	Codec_id codec_id;
+	Pixel_format pixel_format;
+	unsigned int bits_per_raw_pixel;
+	unsigned int max_width;
+	unsigned int max_height;
+
+	bool operator<(const Decoder_key& other) const;
+};
+
+/**
+ * @brief Keeps initialized decoders around, so switching between streams doesn't
+ * have to create new ones. Decoders are created with a max size, so they can be reused
+ * for all streams up to that size. Idle decoders are destroyed when the memory governor
+ * needs their memory for something else
+*/
+class Decoder_pool {
+public:
+	/**
+	 * @param max_width Max width of pooled decoders. Larger streams get a decoder of their own size
+	 * @param max_height Max height of pooled decoders. Larger streams get a decoder of their own size
+	*/
+	Decoder_pool(unsigned int max_width = 1920, unsigned int max_height = 1088);
+	~Decoder_pool();
+
+	/**
+	 * @brief Creates decoders ahead of time, so the first acquire for this kind of stream is fast
+	 * @param stream_info Stream to create decoders for
+	 * @param count Number of idle decoders to have after this call
+	 * @return True on success, false otherwise
+	*/
+	bool prewarm(const Stream_info& stream_info, int count);
+
+	/**
+	 * @brief Gets a decoder for the given stream. An idle decoder is reset and reused if
+	 * there is one, otherwise a new decoder is created
+	 * @param stream_info Stream to decode
+	 * @return Decoder ready to decode the stream, or nullptr on failure
+	*/
+	std::unique_ptr<Decoder> acquire(const Stream_info& stream_info);
+
+	/**
+	 * @brief Returns a decoder to the pool. The decoder is flushed and any remaining frames are
+	 * discarded, so the caller's frame callback is never called from here
+	 * @param decoder Decoder from acquire
+	*/
+	void release(std::unique_ptr<Decoder> decoder);
+
+	/**
+	 * @brief Number of idle decoders in the pool
+	*/
+	size_t size();
+private:
+	Decoder_key make_key(const Stream_info& stream_info);
+	std::unique_ptr<Decoder> create_decoder(const Stream_info& stream_info, const Decoder_key& key, unsigned int num_decode_surfaces);
+	size_t shrink(size_t bytes_needed);
+	unsigned int max_width;
+	unsigned int max_height;
+	std::mutex mutex;
+	std::map<Decoder_key, std::vector<std::unique_ptr<Decoder>>> idle_decoders;
+	std::map<Decoder*, Decoder_key> acquired_decoders;
+	int memory_stream_id;
+};
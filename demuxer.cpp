@@ -1,28 +1,84 @@
-#include <iostream>
+#include <filesystem>
 #include <functional>
 #include <map>
+#include <mutex>
+#include <cstring>
+#include <string>
 
 extern "C"
 {
 #include <libavformat/avformat.h>
 #include <libavcodec/codec_par.h>
 #include <libavcodec/bsf.h>
+#include <libavutil/log.h>
 }
 
 #include "demuxer.h"
+#include "live_input.h"
+#include "log.h"
+#include "probe_cache.h"
 #include "stream_info.h"
+#include "test_stream.h"
 #include "utils.h"
 
 template Codec_id get_from_map(std::map<AVCodecID, Codec_id>, AVCodecID, Codec_id);
 template Pixel_format get_from_map(std::map<AVPixelFormat, Pixel_format>, AVPixelFormat, Pixel_format);
 
-Demuxer::Demuxer() {}
+/**
+ * @brief Passes FFmpeg log messages, including the output of av_dump_format, on to our logger.
+ * FFmpeg often logs one line in several calls, so we collect the parts until there's a newline
+*/
+void ffmpeg_log_callback(void* avcl, int level, const char* format, va_list args) {
+	thread_local std::string line;
+	thread_local int print_prefix = 1;
+	char part[1024];
+
+	if (level > av_log_get_level()) {
+		return;
+	}
+
+	av_log_format_line2(avcl, level, format, args, part, sizeof(part), &print_prefix);
+	line += part;
+
+	if (line.empty() || line.back() != '\n') {
+		return;
+	}
+
+	if (level <= AV_LOG_ERROR) {
+		LOG_ERROR("%s", line.c_str());
+	}
+	else if (level <= AV_LOG_WARNING) {
+		LOG_WARNING("%s", line.c_str());
+	}
+	else if (level <= AV_LOG_INFO) {
+		LOG_INFO("%s", line.c_str());
+	}
+	else if (level <= AV_LOG_DEBUG) {
+		LOG_DEBUG("%s", line.c_str());
+	}
+	else {
+		LOG_TRACE("%s", line.c_str());
+	}
+
+	line.clear();
+}
+
+Demuxer::Demuxer() {
+	static std::once_flag log_callback_flag;
+	std::call_once(log_callback_flag, []() { av_log_set_callback(ffmpeg_log_callback); });
+}
 
 Demuxer::~Demuxer() {
+	// The reader thread uses the format context, and the format context reads from the live input
+	if (live_input) {
+		live_input->stop();
+	}
+
 	av_packet_free(&packet_original);
 	av_packet_free(&packet_filtered);
 	av_bsf_free(&bitstream_filter_context);
 	avformat_close_input(&format_context);
+	live_input.reset();
 }
 
 Stream_info Demuxer::make_stream_info() {
@@ -45,51 +101,237 @@ Stream_info Demuxer::make_stream_info() {
 	stream_info.pixel_format = get_from_map(pixel_format_map, pixel_format, Pixel_format::unsupported);
 	stream_info.height = format_context->streams[idx_video_stream]->codecpar->height;
 	stream_info.width = format_context->streams[idx_video_stream]->codecpar->width;
-	stream_info.bits_per_raw_pixel = format_context->streams[0]->codecpar->bits_per_raw_sample;
+	stream_info.bits_per_raw_pixel = format_context->streams[idx_video_stream]->codecpar->bits_per_raw_sample;
+	stream_info.time_base_num = format_context->streams[idx_video_stream]->time_base.num;
+	stream_info.time_base_den = format_context->streams[idx_video_stream]->time_base.den;
+	stream_info.frame_rate_num = format_context->streams[idx_video_stream]->avg_frame_rate.num;
+	stream_info.frame_rate_den = format_context->streams[idx_video_stream]->avg_frame_rate.den;
+	stream_info.start_time = format_context->streams[idx_video_stream]->start_time != AV_NOPTS_VALUE ?
+		format_context->streams[idx_video_stream]->start_time : 0;
 
 	return stream_info;
 }
 
-bool Demuxer::init(const char* input_file, Stream_info* stream_info) {
+Probe_result Demuxer::make_probe_result() {
+	Probe_result probe_result;
+	auto codecpar = format_context->streams[idx_video_stream]->codecpar;
+	std::string format_name = format_context->iformat->name;
+
+	probe_result.stream_info = make_stream_info();
+	// Format names can be a comma-separated list, eg. "mov,mp4,m4a,3gp,3g2,mj2". av_find_input_format wants one of them
+	probe_result.format_name = format_name.substr(0, format_name.find(','));
+	probe_result.idx_video_stream = idx_video_stream;
+	probe_result.codec_id = codecpar->codec_id;
+	probe_result.format = codecpar->format;
+	probe_result.width = codecpar->width;
+	probe_result.height = codecpar->height;
+	probe_result.bits_per_raw_sample = codecpar->bits_per_raw_sample;
+	probe_result.profile = codecpar->profile;
+	probe_result.level = codecpar->level;
+
+	if (codecpar->extradata && codecpar->extradata_size > 0) {
+		probe_result.extradata.assign(codecpar->extradata, codecpar->extradata + codecpar->extradata_size);
+	}
+
+	return probe_result;
+}
+
+void Demuxer::apply_probe_result(const Probe_result& probe_result) {
+	idx_video_stream = probe_result.idx_video_stream;
+
+	auto codecpar = format_context->streams[idx_video_stream]->codecpar;
+
+	codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+	codecpar->codec_id = static_cast<AVCodecID>(probe_result.codec_id);
+	codecpar->format = probe_result.format;
+	codecpar->width = probe_result.width;
+	codecpar->height = probe_result.height;
+	codecpar->bits_per_raw_sample = probe_result.bits_per_raw_sample;
+	codecpar->profile = probe_result.profile;
+	codecpar->level = probe_result.level;
+
+	// avformat_find_stream_info fills these in, so restore them as well. Seeking relies on the start time
+	auto stream = format_context->streams[idx_video_stream];
+
+	stream->avg_frame_rate = { probe_result.stream_info.frame_rate_num, probe_result.stream_info.frame_rate_den };
+
+	if (stream->start_time == AV_NOPTS_VALUE) {
+		stream->start_time = probe_result.stream_info.start_time;
+	}
+
+	if (!probe_result.extradata.empty()) {
+		// FFmpeg requires extradata to be padded
+		auto extradata = static_cast<uint8_t*>(av_mallocz(probe_result.extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+
+		if (extradata) {
+			memcpy(extradata, probe_result.extradata.data(), probe_result.extradata.size());
+			av_freep(&codecpar->extradata);
+			codecpar->extradata = extradata;
+			codecpar->extradata_size = static_cast<int>(probe_result.extradata.size());
+		}
+	}
+}
+
+bool Demuxer::init(const char* input_file, Stream_info* stream_info, Probe_cache* probe_cache) {
+	Probe_key probe_key;
+	Probe_result probe_result;
+	bool use_probe_cache = probe_cache && Probe_cache::make_key(input_file, probe_key);
+	bool probe_cache_hit = use_probe_cache && probe_cache->find(probe_key, probe_result);
+	const AVInputFormat* input_format = nullptr;
+	AVDictionary* options = nullptr;
+
 	format_context = avformat_alloc_context();
 
-	if (avformat_open_input(&format_context, input_file, nullptr, nullptr) < 0) {
-		std::cout << "Could not open input file " << input_file << std::endl;
+	if (probe_cache_hit) {
+		// We already know what the file contains, so read as little as possible when opening it
+		input_format = av_find_input_format(probe_result.format_name.c_str());
+		av_dict_set(&options, "probesize", "32", 0);
+		av_dict_set(&options, "analyzeduration", "0", 0);
+	}
+
+	auto ret = avformat_open_input(&format_context, input_file, input_format, &options);
+
+	av_dict_free(&options);
+
+	if (ret < 0) {
+		LOG_ERROR("Could not open input file %s", input_file);
+		return false;
+	}
+
+	// Formats where streams are found while reading packets (eg. MPEG-TS) might not have the stream yet. Probe as usual
+	// then, but not with the limits above, or the probe would find too little. Open the input again without them
+	bool probe_cache_rejected = false;
+
+	if (probe_cache_hit && probe_result.idx_video_stream >= static_cast<int>(format_context->nb_streams)) {
+		probe_cache_hit = false;
+		probe_cache_rejected = true;
+		avformat_close_input(&format_context);
+
+		if (avformat_open_input(&format_context, input_file, nullptr, nullptr) < 0) {
+			LOG_ERROR("Could not open input file %s", input_file);
+			return false;
+		}
+	}
+
+	if (probe_cache_hit) {
+		apply_probe_result(probe_result);
+	}
+	else {
+		if (avformat_find_stream_info(format_context, nullptr) < 0) {
+			LOG_ERROR("Could not find stream info");
+			return false;
+		}
+
+		// NB we only take the first stream, will miss out if there are multiple
+		for (unsigned int i = 0; i < format_context->nb_streams; i++) {
+			if (format_context->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+				idx_video_stream = i;
+				break;
+			}
+		}
+
+		av_dump_format(format_context, idx_video_stream, input_file, 0);
+
+		// The rejected entry would be rejected again next time, so there's no point in storing it again
+		if (use_probe_cache && !probe_cache_rejected) {
+			probe_cache->store(probe_key, make_probe_result());
+		}
+	}
+
+	// TODO: Different filters for different video formats. This is for h264 only. See FFmpegDemuxer.h in the NV12 samples
+	if (!init_bitstream_filter("h264_mp4toannexb")) {
+		return false;
+	}
+
+	if (stream_info) {
+		*stream_info = probe_cache_hit ? probe_result.stream_info : make_stream_info();
+	}
+
+	return true;
+}
+
+bool Demuxer::init_live(const char* url, const Live_settings& settings, Stream_info* stream_info) {
+	AVDictionary* options = nullptr;
+
+	live_input = std::make_unique<Live_input>(settings);
+
+	if (!live_input->open(url)) {
+		return false;
+	}
+
+	format_context = avformat_alloc_context();
+	format_context->pb = live_input->get_io_context();
+	format_context->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+	// Everything read while probing is buffered until demuxing starts, so keep it short
+	av_dict_set(&options, "probesize", "1000000", 0);
+	av_dict_set(&options, "analyzeduration", std::to_string(settings.probe_ms * 1000).c_str(), 0);
+
+	auto ret = avformat_open_input(&format_context, url, av_find_input_format("mpegts"), &options);
+
+	av_dict_free(&options);
+
+	if (ret < 0) {
+		LOG_ERROR("Could not open live input %s", url);
 		return false;
 	}
 
 	if (avformat_find_stream_info(format_context, nullptr) < 0) {
-		std::cout << "Could not find stream info" << std::endl;
+		LOG_ERROR("Could not find stream info");
 		return false;
 	}
 
-	// NB we only take the first stream, will miss out if there are multiple
+	idx_video_stream = -1;
+
 	for (unsigned int i = 0; i < format_context->nb_streams; i++) {
 		if (format_context->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
 			idx_video_stream = i;
 			break;
 		}
-	} 
+	}
+
+	if (idx_video_stream < 0) {
+		LOG_ERROR("No video stream in live input %s", url);
+		return false;
+	}
+
+	av_dump_format(format_context, idx_video_stream, url, 0);
+
+	// MPEG-TS already carries Annex B, so the packets are passed on as they are
+	if (!init_bitstream_filter("null")) {
+		return false;
+	}
+
+	if (stream_info) {
+		*stream_info = make_stream_info();
+	}
 
-	av_dump_format(format_context, idx_video_stream, input_file, 0);
+	live_input->start(format_context, idx_video_stream);
 
+	return true;
+}
+
+bool Demuxer::init_bitstream_filter(const char* filter_name) {
 	packet_original = av_packet_alloc();
 	packet_filtered = av_packet_alloc();
 
 	if (!packet_original || !packet_filtered) {
-		std::cout << "Can't allocate packet" << std::endl;
+		LOG_ERROR("Can't allocate packet");
 		return false;
 	}
 
-	// TODO: Different filters for different video formats. This is for h264 only. See FFmpegDemuxer.h in the NV12 samples
-	bitstream_filter = (AVBitStreamFilter*)av_bsf_get_by_name("h264_mp4toannexb");
-	// TODO: Add error handling here
-	av_bsf_alloc(bitstream_filter, &bitstream_filter_context);
-	avcodec_parameters_copy(bitstream_filter_context->par_in, format_context->streams[0]->codecpar); // TODO Right now, we hard-code video stream index here,
-	av_bsf_init(bitstream_filter_context);
+	bitstream_filter = (AVBitStreamFilter*)av_bsf_get_by_name(filter_name);
 
-	if (stream_info) {
-		*stream_info = make_stream_info();
+	if (!bitstream_filter || av_bsf_alloc(bitstream_filter, &bitstream_filter_context) < 0) {
+		LOG_ERROR("Could not create bitstream filter %s", filter_name);
+		return false;
+	}
+
+	avcodec_parameters_copy(bitstream_filter_context->par_in, format_context->streams[idx_video_stream]->codecpar);
+
+	if (av_bsf_init(bitstream_filter_context) < 0) {
+		LOG_ERROR("Could not initialize bitstream filter %s", filter_name);
+		return false;
 	}
 
 	return true;
@@ -100,16 +342,30 @@ bool Demuxer::demux(Packet_data* packet_data) {
 		av_packet_unref(packet_original);
 	}
 
-	int ret;
-	
-	// Skip unwanted packets
-	while (((ret = av_read_frame(format_context, packet_original)) >= 0) && (packet_original->stream_index != idx_video_stream)) {
-		av_packet_unref(packet_original);
+	if (live_input) {
+		bool discontinuity = false;
+
+		if (!live_input->read_packet(packet_original, discontinuity)) {
+			return false;
+		}
+
+		// Drop anything the bitstream filter holds from before the loss
+		if (discontinuity) {
+			av_bsf_flush(bitstream_filter_context);
+		}
 	}
+	else {
+		int ret;
 
-	if (ret < 0) {
-		// End of stream; return
-		return false;
+		// Skip unwanted packets
+		while (((ret = av_read_frame(format_context, packet_original)) >= 0) && (packet_original->stream_index != idx_video_stream)) {
+			av_packet_unref(packet_original);
+		}
+
+		if (ret < 0) {
+			// End of stream; return
+			return false;
+		}
 	}
 
 	if (packet_filtered->data) {
@@ -120,8 +376,108 @@ bool Demuxer::demux(Packet_data* packet_data) {
 	av_bsf_send_packet(bitstream_filter_context, packet_original);
 	av_bsf_receive_packet(bitstream_filter_context, packet_filtered);
 
-	packet_data->size = static_cast<int>(packet_filtered->buf->size);
-	packet_data->data = packet_filtered->buf->data;
+	// The buffer can be larger than the packet, eg. because of padding
+	packet_data->size = packet_filtered->size;
+	packet_data->data = packet_filtered->data;
+	packet_data->timestamp = packet_filtered->pts;
+	packet_data->is_key_frame = (packet_filtered->flags & AV_PKT_FLAG_KEY) != 0;
 
 	return true;
+}
+
+bool Demuxer::seek(double seconds) {
+	if (live_input) {
+		LOG_ERROR("Can't seek in live input");
+		return false;
+	}
+
+	auto stream = format_context->streams[idx_video_stream];
+	auto timestamp = static_cast<int64_t>(seconds / av_q2d(stream->time_base));
+
+	if (stream->start_time != AV_NOPTS_VALUE) {
+		timestamp += stream->start_time;
+	}
+
+	if (av_seek_frame(format_context, idx_video_stream, timestamp, AVSEEK_FLAG_BACKWARD) < 0) {
+		LOG_ERROR("Could not seek to %.3f s", seconds);
+		return false;
+	}
+
+	// Drop anything the bitstream filter holds from before the seek
+	av_bsf_flush(bitstream_filter_context);
+
+	return true;
+}
+
+Live_stats Demuxer::get_live_stats() {
+	return live_input ? live_input->get_stats() : Live_stats();
+}
+
+bool same_stream_info(const Stream_info& a, const Stream_info& b) {
+	return a.codec_id == b.codec_id && a.pixel_format == b.pixel_format && a.width == b.width && a.height == b.height
+		&& a.bits_per_raw_pixel == b.bits_per_raw_pixel && a.time_base_num == b.time_base_num && a.time_base_den == b.time_base_den
+		&& a.frame_rate_num == b.frame_rate_num && a.frame_rate_den == b.frame_rate_den && a.start_time == b.start_time;
+}
+
+/**
+ * @brief Opens the file, seeks and returns the stream info and the timestamp of the first packet after seeking
+*/
+bool open_probe_test_file(const std::string& path, Probe_cache* probe_cache, Stream_info& stream_info, long long& seek_timestamp) {
+	Demuxer demuxer;
+	Packet_data packet_data;
+
+	if (!demuxer.init(path.c_str(), &stream_info, probe_cache) || !demuxer.seek(1.0) || !demuxer.demux(&packet_data)) {
+		return false;
+	}
+
+	seek_timestamp = packet_data.timestamp;
+
+	return true;
+}
+
+bool probe_cache_selftest() {
+	Test_stream test_stream;
+	bool ok = true;
+
+	test_stream.segments = { { 320, 240, 100 } };
+
+	if (!encode_test_stream(test_stream)) {
+		return false;
+	}
+
+	// Matroska has its streams in the header, so the cached result is used. MPEG-TS doesn't, so the cached result is rejected
+	for (auto format_name : { "matroska", "mpegts" }) {
+		auto path = (std::filesystem::temp_directory_path() / (std::string("probe_cache_selftest.") + format_name)).string();
+		Probe_cache probe_cache;
+		Probe_key probe_key;
+		Probe_result probe_result;
+		Stream_info uncached_info, first_info, cached_info;
+		long long uncached_timestamp = 0, first_timestamp = 0, cached_timestamp = 0;
+
+		if (!write_test_stream(test_stream, path, format_name)) {
+			return false;
+		}
+
+		// The second open with the cache finds the result stored by the first
+		bool opened = open_probe_test_file(path, nullptr, uncached_info, uncached_timestamp)
+			&& open_probe_test_file(path, &probe_cache, first_info, first_timestamp)
+			&& Probe_cache::make_key(path.c_str(), probe_key) && probe_cache.find(probe_key, probe_result)
+			&& open_probe_test_file(path, &probe_cache, cached_info, cached_timestamp);
+		bool same = opened && same_stream_info(uncached_info, first_info) && same_stream_info(uncached_info, cached_info)
+			&& uncached_timestamp == first_timestamp && uncached_timestamp == cached_timestamp;
+
+		if (!same) {
+			LOG_ERROR("Probe cache test with %s: %s", format_name, opened ? "cached and uncached open differ" : "could not open");
+			LOG_ERROR("Start time %lld, %lld, %lld, first packet after seeking %lld, %lld, %lld", uncached_info.start_time,
+				first_info.start_time, cached_info.start_time, uncached_timestamp, first_timestamp, cached_timestamp);
+			ok = false;
+		}
+
+		std::error_code ec;
+		std::filesystem::remove(path, ec);
+	}
+
+	LOG_INFO("Probe cache test %s", ok ? "passed" : "failed");
+
+	return ok;
 }
\ No newline at end of file
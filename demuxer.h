@@ -1,10 +1,17 @@
 #pragma once
 
+#include <memory>
+
 struct AVFormatContext;
 struct AVPacket;
 struct AVBitStreamFilter;
 struct AVBSFContext;
 struct Stream_info;
+struct Probe_result;
+class Probe_cache;
+struct Live_settings;
+struct Live_stats;
+class Live_input;
 
 /**
  * @brief Size of demuxed data and a pointer to the data buffer
@@ -13,6 +20,11 @@ class Packet_data {
 public:
 	unsigned char* data;
 	int size;
+	/**
+	 * @brief Presentation timestamp, in stream time base
+	*/
+	long long timestamp;
+	bool is_key_frame;
 };
 
 /**
@@ -27,22 +39,57 @@ public:
 	 * @brief Initializes the demuxer
 	 * @param input_file Video file to demux
 	 * @param stream_info Optional out parameter, will be updated with stream info if provided
+	 * @param probe_cache Optional probe cache. On a cache hit, stream info discovery is skipped
 	 * @return True on success, false otherwise
 	*/
-	bool init(const char* input_file, Stream_info* stream_info = nullptr);
+	bool init(const char* input_file, Stream_info* stream_info = nullptr, Probe_cache* probe_cache = nullptr);
 
 	/**
-	 * @brief Demux the next packet
+	 * @brief Initializes the demuxer for live MPEG-TS, eg. from a pipe or a localhost UDP socket. Packets go
+	 * through a jitter buffer, and after lost data demuxing continues at the next key frame. See Live_input
+	 * @param url Input URL, eg. "pipe:0" or "udp://127.0.0.1:1234"
+	 * @param settings Jitter buffer settings
+	 * @param stream_info Optional out parameter, will be updated with stream info if provided
+	 * @return True on success, false otherwise
+	*/
+	bool init_live(const char* url, const Live_settings& settings, Stream_info* stream_info = nullptr);
+
+	/**
+	 * @brief Demux the next packet. For live input, this waits until the packet is due
 	 * @param packet_data This structure will be filled by this function
 	 * @return True on success, false otherwise or if the video is at the end
 	*/
 	bool demux(Packet_data* packet_data);
+
+	/**
+	 * @brief Seeks to the key frame at or before the given time. Decoders fed by this demuxer
+	 * should be reset after seeking
+	 * @param seconds Time from the start of the stream
+	 * @return True on success, false otherwise. Live input can't seek
+	*/
+	bool seek(double seconds);
+
+	/**
+	 * @brief Loss and jitter buffer stats of live input. All zero for files
+	*/
+	Live_stats get_live_stats();
 private:
 	Stream_info make_stream_info();
+	Probe_result make_probe_result();
+	void apply_probe_result(const Probe_result& probe_result);
+	bool init_bitstream_filter(const char* filter_name);
 	int idx_video_stream = 0;
 	AVFormatContext* format_context = nullptr;
 	AVPacket* packet_original = nullptr;
 	AVPacket* packet_filtered = nullptr;
 	AVBitStreamFilter* bitstream_filter = nullptr;
 	AVBSFContext* bitstream_filter_context = nullptr;
-};
\ No newline at end of file
+	std::unique_ptr<Live_input> live_input;
+};
+
+/**
+ * @brief Opens generated Matroska and MPEG-TS files without the probe cache, and twice with it, and checks that
+ * all three give the same stream info and land on the same packet when seeking. Needs an H.264 encoder in FFmpeg
+ * @return True if the check passed, false otherwise
+*/
+bool probe_cache_selftest();
\ No newline at end of file
@@ -0,0 +1,647 @@
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <string>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+#include "demuxer.h"
+#include "live_input.h"
+#include "log.h"
+#include "memory_governor.h"
+#include "stream_info.h"
+#include "test_stream.h"
+
+/**
+ * @brief Larger timestamp jumps are taken as a restart of the source, and the clock is set again
+*/
+const double max_timestamp_jump = 5.0;
+
+void Ts_continuity_checker::feed(const unsigned char* data, size_t size) {
+	const size_t packet_size = sizeof(partial);
+
+	while (size > 0) {
+		if (partial_size == 0) {
+			if (data[0] != 0x47) {
+				if (in_sync) {
+					num_sync_losses++;
+					in_sync = false;
+				}
+
+				// Skip to the next sync byte
+				auto sync_byte = static_cast<const unsigned char*>(memchr(data, 0x47, size));
+				size_t num_skipped = sync_byte ? sync_byte - data : size;
+
+				stream_offset += num_skipped;
+				data += num_skipped;
+				size -= num_skipped;
+				continue;
+			}
+
+			in_sync = true;
+
+			if (size >= packet_size) {
+				check_packet(data, stream_offset);
+				stream_offset += packet_size;
+				data += packet_size;
+				size -= packet_size;
+				continue;
+			}
+		}
+
+		auto num_copied = std::min(packet_size - partial_size, size);
+
+		memcpy(partial + partial_size, data, num_copied);
+		partial_size += num_copied;
+		data += num_copied;
+		size -= num_copied;
+
+		if (partial_size == packet_size) {
+			check_packet(partial, stream_offset);
+			stream_offset += packet_size;
+			partial_size = 0;
+		}
+	}
+}
+
+void Ts_continuity_checker::check_packet(const unsigned char* packet, int64_t offset) {
+	int pid = ((packet[1] & 0x1f) << 8) | packet[2];
+
+	num_packets++;
+
+	// Null packets don't have a continuity counter
+	if (pid == 0x1fff) {
+		return;
+	}
+
+	bool transport_error = (packet[1] & 0x80) != 0;
+	int adaptation_field_control = (packet[3] >> 4) & 0x3;
+	int counter = packet[3] & 0xf;
+	bool has_payload = (adaptation_field_control & 0x1) != 0;
+	bool discontinuity = (adaptation_field_control & 0x2) && packet[4] > 0 && (packet[5] & 0x80);
+	auto pid_state = pids.find(pid);
+
+	if (transport_error) {
+		// The packet itself is damaged, so the gap is in the PES packet it belongs to
+		gaps.push_back({ pid, offset });
+		return;
+	}
+
+	// The counter only increases on packets with payload. A packet may be sent twice, with the same counter
+	if (pid_state != pids.end() && !discontinuity && has_payload && counter != pid_state->second.counter) {
+		int num_missing = (counter - pid_state->second.counter - 1) & 0xf;
+
+		if (num_missing > 0) {
+			num_lost_packets += num_missing;
+			gaps.push_back({ pid, pid_state->second.offset });
+		}
+	}
+
+	pids[pid] = { counter, offset };
+}
+
+std::vector<Ts_continuity_checker::Gap> Ts_continuity_checker::take_gaps() {
+	std::vector<Gap> result;
+
+	result.swap(gaps);
+
+	return result;
+}
+
+Live_input::Live_input(const Live_settings& settings) : settings(settings) {
+	stats.buffer_capacity = settings.max_packets;
+	memory_stream_id = Memory_governor::get().register_stream("live jitter buffer");
+}
+
+Live_input::~Live_input() {
+	stop();
+
+	while (!buffer.empty()) {
+		drop_front();
+	}
+
+	if (io_context) {
+		av_freep(&io_context->buffer);
+		avio_context_free(&io_context);
+	}
+
+	avio_closep(&input);
+	Memory_governor::get().unregister_stream(memory_stream_id);
+}
+
+bool Live_input::open(const char* url) {
+	static std::once_flag network_flag;
+	std::call_once(network_flag, []() { avformat_network_init(); });
+
+	// Lets blocking reads, eg. on a UDP socket, return when stopped
+	AVIOInterruptCB interrupt = { interrupt_callback, this };
+
+	if (avio_open2(&input, url, AVIO_FLAG_READ, &interrupt, nullptr) < 0) {
+		LOG_ERROR("Could not open live input %s", url);
+		return false;
+	}
+
+	const int buffer_size = 32768;
+	auto io_buffer = static_cast<unsigned char*>(av_malloc(buffer_size));
+
+	if (io_buffer) {
+		io_context = avio_alloc_context(io_buffer, buffer_size, 0, this, read_callback, nullptr, nullptr);
+	}
+
+	if (!io_context) {
+		av_free(io_buffer);
+		LOG_ERROR("Could not allocate IO context for %s", url);
+		return false;
+	}
+
+	return true;
+}
+
+int Live_input::read_callback(void* opaque, uint8_t* buffer, int size) {
+	auto live_input = static_cast<Live_input*>(opaque);
+
+	if (live_input->stopped) {
+		return AVERROR_EXIT;
+	}
+
+	// Returns what is available, rather than waiting for the whole buffer to fill
+	auto ret = avio_read_partial(live_input->input, buffer, size);
+
+	if (ret <= 0) {
+		return ret == 0 ? AVERROR_EOF : ret;
+	}
+
+	auto& continuity_checker = live_input->continuity_checker;
+
+	continuity_checker.feed(buffer, ret);
+
+	// Only the thread demuxing reads, so the gaps need no lock
+	for (auto& gap : continuity_checker.take_gaps()) {
+		live_input->gaps.push_back(gap);
+	}
+
+	std::lock_guard<std::mutex> lock(live_input->mutex);
+
+	live_input->stats.num_ts_packets = continuity_checker.get_num_packets();
+	live_input->stats.num_lost_ts_packets = continuity_checker.get_num_lost_packets();
+	live_input->stats.num_sync_losses = continuity_checker.get_num_sync_losses();
+
+	return ret;
+}
+
+int Live_input::interrupt_callback(void* opaque) {
+	return static_cast<Live_input*>(opaque)->stopped ? 1 : 0;
+}
+
+void Live_input::start(AVFormatContext* format_context, int idx_video_stream) {
+	auto stream = format_context->streams[idx_video_stream];
+
+	this->format_context = format_context;
+	this->idx_video_stream = idx_video_stream;
+	// In MPEG-TS, the stream id is the PID
+	video_pid = stream->id;
+	time_base = av_q2d(stream->time_base);
+	reader_thread = std::thread(&Live_input::run, this);
+}
+
+void Live_input::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopped = true;
+	}
+
+	packet_ready.notify_all();
+
+	if (reader_thread.joinable()) {
+		reader_thread.join();
+	}
+}
+
+void Live_input::run() {
+	AVPacket* packet = av_packet_alloc();
+	AVPacket* pending_packet = nullptr;
+
+	while (packet && !stopped) {
+		if (av_read_frame(format_context, packet) < 0) {
+			if (!stopped) {
+				LOG_INFO("Live input ended");
+			}
+
+			break;
+		}
+
+		if (packet->stream_index != idx_video_stream) {
+			av_packet_unref(packet);
+			continue;
+		}
+
+		// A gap belongs to a packet if it's before the start of the next packet, so one packet is held back
+		if (pending_packet) {
+			push(pending_packet, is_corrupt(pending_packet, packet->pos >= 0 ? packet->pos : INT64_MAX));
+		}
+
+		pending_packet = av_packet_alloc();
+
+		if (pending_packet) {
+			av_packet_move_ref(pending_packet, packet);
+		}
+		else {
+			av_packet_unref(packet);
+		}
+	}
+
+	if (pending_packet) {
+		push(pending_packet, is_corrupt(pending_packet, INT64_MAX));
+	}
+
+	av_packet_free(&packet);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		ended = true;
+	}
+
+	packet_ready.notify_all();
+}
+
+bool Live_input::is_corrupt(AVPacket* packet, int64_t next_offset) {
+	// FFmpeg flags packets with continuity errors too, but not all versions do, and it doesn't count them
+	bool corrupt = (packet->flags & AV_PKT_FLAG_CORRUPT) != 0;
+
+	// Earlier gaps were taken by earlier packets, so all gaps before the next packet are in this one
+	auto end = std::remove_if(gaps.begin(), gaps.end(), [&](const Ts_continuity_checker::Gap& gap) {
+		if (gap.offset >= next_offset) {
+			return false;
+		}
+
+		corrupt |= gap.pid == video_pid;
+
+		return true;
+	});
+
+	gaps.erase(end, gaps.end());
+
+	return corrupt;
+}
+
+void Live_input::push(AVPacket* packet, bool corrupt) {
+	std::unique_lock<std::mutex> lock(mutex);
+	auto now = Clock::now();
+	auto latency = std::chrono::milliseconds(settings.latency_ms);
+	auto timestamp = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts != AV_NOPTS_VALUE ? packet->pts : last_timestamp;
+	bool discontinuity = false;
+
+	last_timestamp = timestamp;
+	stats.num_packets++;
+
+	if (last_released_timestamp != INT64_MIN && (last_released_timestamp - timestamp) * time_base > max_timestamp_jump) {
+		LOG_WARNING("Live input timestamps jumped back, restarting");
+
+		while (!buffer.empty()) {
+			stats.num_dropped_packets++;
+			drop_front();
+		}
+
+		last_released_timestamp = INT64_MIN;
+		clock_started = false;
+		start_resync();
+	}
+
+	if (corrupt) {
+		LOG_WARNING_LIMITED(10, "Live input lost data in packet at %lld", static_cast<long long>(timestamp));
+		stats.num_corrupt_packets++;
+		start_resync();
+		av_packet_free(&packet);
+		return;
+	}
+
+	if (resyncing) {
+		if (!(packet->flags & AV_PKT_FLAG_KEY)) {
+			stats.num_skipped_packets++;
+			av_packet_free(&packet);
+			return;
+		}
+
+		resyncing = false;
+		discontinuity = true;
+	}
+
+	if (timestamp < last_released_timestamp) {
+		// Later packets may depend on this one
+		LOG_WARNING_LIMITED(10, "Live input packet at %lld arrived too late", static_cast<long long>(timestamp));
+		stats.num_dropped_packets++;
+		stats.num_late_packets++;
+		av_packet_free(&packet);
+		discard_until_key_frame();
+		return;
+	}
+
+	auto due_time = anchor_time + std::chrono::duration_cast<Clock::duration>(
+		std::chrono::duration<double>((timestamp - anchor_timestamp) * time_base)) + latency;
+
+	if (clock_started && now > due_time) {
+		stats.num_late_packets++;
+	}
+
+	// Set the clock on the first packet, after a timestamp jump, and when packets arrive much later than
+	// the timestamps say, eg. because the source runs slower than real time. Otherwise the buffer would drain
+	if (!clock_started || due_time - now > latency + std::chrono::duration<double>(max_timestamp_jump) || now - due_time > latency) {
+		clock_started = true;
+		anchor_time = now;
+		anchor_timestamp = timestamp;
+		due_time = now + latency;
+	}
+
+	if (!Memory_governor::get().reserve(memory_stream_id, Memory_category::queue, packet->size)) {
+		LOG_WARNING_LIMITED(1, "Dropping live packet, no memory budget for jitter buffer");
+		stats.num_dropped_packets++;
+		start_resync();
+		av_packet_free(&packet);
+		return;
+	}
+
+	buffer.emplace(std::make_pair(timestamp, num_arrived++), Buffered_packet{ packet, packet->size, due_time, discontinuity });
+	buffer_bytes += packet->size;
+
+	if (static_cast<int>(buffer.size()) > settings.max_packets) {
+		LOG_WARNING_LIMITED(10, "Live jitter buffer is full, dropping oldest packet");
+		stats.num_dropped_packets++;
+		drop_front();
+		discard_until_key_frame();
+	}
+
+	lock.unlock();
+	packet_ready.notify_one();
+}
+
+void Live_input::start_resync() {
+	if (!resyncing) {
+		stats.num_resyncs++;
+	}
+
+	resyncing = true;
+}
+
+void Live_input::discard_until_key_frame() {
+	// The buffered packets after a dropped one may depend on it
+	while (!buffer.empty()) {
+		auto& buffered_packet = buffer.begin()->second;
+
+		// A key frame that is already marked is where an earlier loss resumes. This loss resumes there too,
+		// so it's the same resync
+		if (buffered_packet.packet->flags & AV_PKT_FLAG_KEY) {
+			if (!buffered_packet.discontinuity) {
+				buffered_packet.discontinuity = true;
+				stats.num_resyncs++;
+			}
+
+			return;
+		}
+
+		stats.num_skipped_packets++;
+		drop_front();
+	}
+
+	start_resync();
+}
+
+void Live_input::drop_front() {
+	auto& buffered_packet = buffer.begin()->second;
+
+	Memory_governor::get().release(memory_stream_id, Memory_category::queue, buffered_packet.size);
+	buffer_bytes -= buffered_packet.size;
+	av_packet_free(&buffered_packet.packet);
+	buffer.erase(buffer.begin());
+}
+
+bool Live_input::read_packet(AVPacket* packet, bool& discontinuity) {
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (!stopped) {
+		if (buffer.empty()) {
+			if (ended) {
+				return false;
+			}
+
+			packet_ready.wait(lock);
+			continue;
+		}
+
+		auto& buffered_packet = buffer.begin()->second;
+		auto due_time = buffered_packet.due_time;
+
+		if (Clock::now() < due_time) {
+			// A packet that is due earlier may come in while waiting
+			packet_ready.wait_until(lock, due_time);
+			continue;
+		}
+
+		discontinuity = buffered_packet.discontinuity;
+		last_released_timestamp = buffer.begin()->first.first;
+		av_packet_move_ref(packet, buffered_packet.packet);
+		drop_front();
+
+		return true;
+	}
+
+	return false;
+}
+
+Live_stats Live_input::get_stats() {
+	std::lock_guard<std::mutex> lock(mutex);
+	Live_stats result = stats;
+
+	result.buffer_packets = static_cast<int>(buffer.size());
+
+	if (!buffer.empty()) {
+		result.buffer_ms = (buffer.rbegin()->first.first - buffer.begin()->first.first) * time_base * 1000.0;
+	}
+
+	return result;
+}
+
+/**
+ * @brief The generated test stream, muxed to MPEG-TS in memory
+*/
+struct Live_test_stream {
+	Test_stream stream;
+	std::vector<unsigned char> ts_data;
+	/**
+	 * @brief End of the TS data of each packet and its decode time in seconds, to pace the sending
+	*/
+	std::vector<std::pair<size_t, double>> schedule;
+};
+
+/**
+ * @brief Creates the test stream, muxed to MPEG-TS in memory
+*/
+bool make_live_test_stream(Live_test_stream& test_stream, int num_frames) {
+	std::vector<size_t> packet_ends;
+
+	test_stream.stream.segments = { { 320, 240, num_frames } };
+
+	if (!encode_test_stream(test_stream.stream) || !mux_test_stream(test_stream.stream, test_stream.ts_data, &packet_ends)) {
+		return false;
+	}
+
+	for (size_t i = 0; i < packet_ends.size(); i++) {
+		test_stream.schedule.emplace_back(packet_ends[i], static_cast<double>(test_stream.stream.packets[i].dts) / test_stream.stream.frame_rate);
+	}
+
+	return !test_stream.schedule.empty();
+}
+
+/**
+ * @brief Counts of what the sender left out
+*/
+struct Live_test_losses {
+	int num_datagrams = 0;
+	int num_ts_packets = 0;
+};
+
+/**
+ * @brief Sends the test stream at its own pace in UDP datagrams of 7 TS packets. Each datagram is
+ * delayed by a random amount, once by more than the latency, and some datagrams are not sent at all
+*/
+void send_live_test_stream(const Live_test_stream& test_stream, std::string url, int max_jitter_ms, double loss_rate, Live_test_losses& losses) {
+	const size_t datagram_size = 7 * 188;
+	AVIOContext* output = nullptr;
+	std::mt19937 random(1234);
+	std::uniform_real_distribution<double> distribution(0.0, 1.0);
+	bool stalled = false;
+
+	if (avio_open(&output, url.c_str(), AVIO_FLAG_WRITE) < 0) {
+		LOG_ERROR("Could not open %s for sending", url.c_str());
+		return;
+	}
+
+	// Give the receiver time to open its socket
+	auto start_time = std::chrono::steady_clock::now() + std::chrono::milliseconds(300);
+	auto first_seconds = test_stream.schedule.front().second;
+	size_t idx_schedule = 0;
+
+	for (size_t offset = 0; offset < test_stream.ts_data.size(); offset += datagram_size) {
+		auto size = std::min(datagram_size, test_stream.ts_data.size() - offset);
+
+		while (idx_schedule + 1 < test_stream.schedule.size() && test_stream.schedule[idx_schedule].first <= offset) {
+			idx_schedule++;
+		}
+
+		auto seconds = test_stream.schedule[idx_schedule].second - first_seconds;
+		auto delay_ms = distribution(random) * max_jitter_ms;
+
+		if (!stalled && seconds > 3.0) {
+			delay_ms += 300;
+			stalled = true;
+		}
+
+		std::this_thread::sleep_until(start_time + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(seconds + delay_ms / 1000.0)));
+
+		// The first second is always sent, so the receiver can find the stream
+		if (seconds > 1.0 && distribution(random) < loss_rate) {
+			losses.num_datagrams++;
+			losses.num_ts_packets += static_cast<int>(size / 188);
+			continue;
+		}
+
+		avio_write(output, test_stream.ts_data.data() + offset, static_cast<int>(size));
+		avio_flush(output);
+	}
+
+	avio_closep(&output);
+}
+
+void log_live_stats(const Live_stats& stats) {
+	LOG_INFO("Live input: %lld TS packets, %lld lost, %lld sync losses; %lld packets, %lld corrupt, %lld late, %lld dropped, %lld skipped, %lld resyncs; buffer %d/%d packets, %.0f ms",
+		static_cast<long long>(stats.num_ts_packets), static_cast<long long>(stats.num_lost_ts_packets), static_cast<long long>(stats.num_sync_losses),
+		static_cast<long long>(stats.num_packets), static_cast<long long>(stats.num_corrupt_packets), static_cast<long long>(stats.num_late_packets),
+		static_cast<long long>(stats.num_dropped_packets), static_cast<long long>(stats.num_skipped_packets), static_cast<long long>(stats.num_resyncs),
+		stats.buffer_packets, stats.buffer_capacity, stats.buffer_ms);
+}
+
+bool live_selftest(int port) {
+	Live_test_stream test_stream;
+	Live_test_losses losses;
+	Live_settings settings;
+
+	if (!make_live_test_stream(test_stream, 200)) {
+		return false;
+	}
+
+	auto& sent_packets = test_stream.stream.packets;
+
+	LOG_INFO("Live test stream: %zu packets, %zu bytes of MPEG-TS", sent_packets.size(), test_stream.ts_data.size());
+
+	auto address = "udp://127.0.0.1:" + std::to_string(port);
+	std::thread sender_thread(send_live_test_stream, std::cref(test_stream), address + "?pkt_size=1316", 60, 0.01, std::ref(losses));
+	std::vector<std::vector<unsigned char>> received_packets;
+	Packet_data packet_data;
+	Live_stats stats;
+
+	{
+		Demuxer demuxer;
+		// The input ends when nothing arrives for two seconds
+		auto url = address + "?timeout=2000000";
+
+		if (demuxer.init_live(url.c_str(), settings)) {
+			auto last_log_time = std::chrono::steady_clock::now();
+
+			while (demuxer.demux(&packet_data)) {
+				received_packets.emplace_back(packet_data.data, packet_data.data + packet_data.size);
+
+				if (std::chrono::steady_clock::now() - last_log_time > std::chrono::seconds(1)) {
+					log_live_stats(demuxer.get_live_stats());
+					last_log_time = std::chrono::steady_clock::now();
+				}
+			}
+
+			stats = demuxer.get_live_stats();
+		}
+	}
+
+	sender_thread.join();
+	log_live_stats(stats);
+	LOG_INFO("Sender left out %d datagrams, %d TS packets", losses.num_datagrams, losses.num_ts_packets);
+
+	if (received_packets.empty()) {
+		LOG_ERROR("Live test received nothing");
+		return false;
+	}
+
+	// The muxer may add an access unit delimiter, so the sent packet only has to be inside the received one
+	size_t idx_next = 0;
+	int num_missing = 0;
+	bool ok = true;
+
+	for (size_t i = 0; i < received_packets.size() && ok; i++) {
+		auto& received = received_packets[i];
+		auto idx_sent = idx_next;
+
+		while (idx_sent < sent_packets.size() && std::search(received.begin(), received.end(),
+			sent_packets[idx_sent].data.begin(), sent_packets[idx_sent].data.end()) == received.end()) {
+			idx_sent++;
+		}
+
+		if (idx_sent == sent_packets.size()) {
+			LOG_ERROR("Received packet %zu is corrupt or out of order", i);
+			ok = false;
+		}
+		else if (idx_sent > idx_next && !sent_packets[idx_sent].is_key_frame) {
+			LOG_ERROR("Stream continued on packet %zu after a loss, which isn't a key frame", idx_sent);
+			ok = false;
+		}
+
+		num_missing += static_cast<int>(idx_sent - idx_next);
+		idx_next = idx_sent + 1;
+	}
+
+	LOG_INFO("Live test %s: received %zu of %zu packets intact, %d skipped", ok ? "passed" : "failed",
+		received_packets.size(), sent_packets.size(), num_missing);
+
+	return ok;
+}
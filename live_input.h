@@ -0,0 +1,227 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct AVFormatContext;
+struct AVIOContext;
+struct AVPacket;
+
+struct Live_settings {
+	/**
+	 * @brief How long packets are held back before they are released, to absorb arrival jitter
+	*/
+	int latency_ms = 200;
+	/**
+	 * @brief Most packets in the jitter buffer. When it's full, the oldest packet is dropped and the stream resyncs
+	*/
+	int max_packets = 256;
+	/**
+	 * @brief How much of the stream is read to find the video stream. Live streams can't be rewound, so keep this small
+	*/
+	int probe_ms = 500;
+};
+
+/**
+ * @brief Counters since the live input was opened, plus the current jitter buffer fill
+*/
+struct Live_stats {
+	int64_t num_ts_packets = 0;
+	/**
+	 * @brief TS packets missing according to the continuity counters, on all PIDs. A counter only
+	 * has 16 values, so a gap of 16 or more packets on one PID is counted modulo 16
+	*/
+	int64_t num_lost_ts_packets = 0;
+	/**
+	 * @brief Times the input didn't start with a sync byte where a TS packet was expected
+	*/
+	int64_t num_sync_losses = 0;
+	/**
+	 * @brief Video packets demuxed
+	*/
+	int64_t num_packets = 0;
+	/**
+	 * @brief Video packets with data missing, from continuity counter gaps or flagged by the demuxer
+	*/
+	int64_t num_corrupt_packets = 0;
+	/**
+	 * @brief Video packets that arrived after they were due. They are still released, if they are in order
+	*/
+	int64_t num_late_packets = 0;
+	/**
+	 * @brief Video packets dropped because they were older than the last released packet, or the buffer was full
+	*/
+	int64_t num_dropped_packets = 0;
+	/**
+	 * @brief Video packets discarded while waiting for a key frame after a resync
+	*/
+	int64_t num_skipped_packets = 0;
+	/**
+	 * @brief Losses after which demuxing continued at a key frame. Further losses before that key frame count as the same one
+	*/
+	int64_t num_resyncs = 0;
+	int buffer_packets = 0;
+	int buffer_capacity = 0;
+	/**
+	 * @brief Time span of the packets in the jitter buffer
+	*/
+	double buffer_ms = 0;
+};
+
+/**
+ * @brief Checks the continuity counters of an MPEG-TS byte stream. Data can be passed in chunks of any
+ * size; TS packets split over chunks are put back together
+*/
+class Ts_continuity_checker {
+public:
+	/**
+	 * @brief A gap in the continuity counters
+	*/
+	struct Gap {
+		int pid;
+		/**
+		 * @brief Stream offset of the last TS packet of the PID before the gap. The missing data belongs
+		 * to the PES packet this TS packet is part of
+		*/
+		int64_t offset;
+	};
+
+	void feed(const unsigned char* data, size_t size);
+
+	/**
+	 * @brief Gaps found since the last call, in stream order
+	*/
+	std::vector<Gap> take_gaps();
+
+	int64_t get_num_packets() { return num_packets; }
+	int64_t get_num_lost_packets() { return num_lost_packets; }
+	int64_t get_num_sync_losses() { return num_sync_losses; }
+private:
+	struct Pid_state {
+		int counter;
+		int64_t offset;
+	};
+
+	void check_packet(const unsigned char* packet, int64_t offset);
+	unsigned char partial[188];
+	size_t partial_size = 0;
+	int64_t stream_offset = 0;
+	bool in_sync = true;
+	std::map<int, Pid_state> pids;
+	std::vector<Gap> gaps;
+	int64_t num_packets = 0;
+	int64_t num_lost_packets = 0;
+	int64_t num_sync_losses = 0;
+};
+
+/**
+ * @brief Live MPEG-TS input, eg. from a capture process over a pipe ("pipe:0") or a localhost UDP socket
+ * ("udp://127.0.0.1:1234"). Used by Demuxer::init_live. The bytes are read through a custom IO context, so
+ * the continuity counters are checked before FFmpeg demuxes them. A reader thread demuxes the video packets
+ * into a jitter buffer, ordered on decode timestamp. Packets are released when they are due: the first
+ * packet after the latency, and the others at the same pace as their timestamps. After lost or dropped
+ * data, packets are discarded until the next key frame, so the decoder never gets corrupt data
+*/
+class Live_input {
+public:
+	Live_input(const Live_settings& settings);
+	~Live_input();
+
+	/**
+	 * @brief Opens the input
+	 * @param url Any URL FFmpeg can read from
+	 * @return True on success, false otherwise
+	*/
+	bool open(const char* url);
+
+	/**
+	 * @brief IO context to demux from, with AVFMT_FLAG_CUSTOM_IO. Valid until this object is destroyed
+	*/
+	AVIOContext* get_io_context() { return io_context; }
+
+	/**
+	 * @brief Starts the reader thread. The format context must not be used by anyone else until stop
+	 * @param format_context Opened input, reading from get_io_context
+	 * @param idx_video_stream Stream to buffer. Other streams are skipped
+	*/
+	void start(AVFormatContext* format_context, int idx_video_stream);
+
+	/**
+	 * @brief Stops the reader thread, and wakes up read_packet. Blocking reads on a pipe only return
+	 * when there's data or the writer closes it
+	*/
+	void stop();
+
+	/**
+	 * @brief Waits until the next packet is due, and takes it from the jitter buffer
+	 * @param packet Filled by this function
+	 * @param discontinuity Set to true if packets were lost or skipped before this one. It's a key frame then
+	 * @return True on success, false if the input ended or was stopped
+	*/
+	bool read_packet(AVPacket* packet, bool& discontinuity);
+
+	Live_stats get_stats();
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Buffered_packet {
+		AVPacket* packet;
+		int size;
+		Clock::time_point due_time;
+		bool discontinuity;
+	};
+
+	static int read_callback(void* opaque, uint8_t* buffer, int size);
+	static int interrupt_callback(void* opaque);
+	void run();
+	bool is_corrupt(AVPacket* packet, int64_t next_offset);
+	void push(AVPacket* packet, bool corrupt);
+	void start_resync();
+	void discard_until_key_frame();
+	void drop_front();
+	Live_settings settings;
+	AVIOContext* input = nullptr;
+	AVIOContext* io_context = nullptr;
+	AVFormatContext* format_context = nullptr;
+	int idx_video_stream = 0;
+	int video_pid = -1;
+	double time_base = 0;
+	Ts_continuity_checker continuity_checker;
+	std::vector<Ts_continuity_checker::Gap> gaps;
+	std::thread reader_thread;
+	std::mutex mutex;
+	std::condition_variable packet_ready;
+	/**
+	 * @brief Keyed on (decode timestamp, arrival number), so packets with equal timestamps keep their order
+	*/
+	std::map<std::pair<int64_t, int64_t>, Buffered_packet> buffer;
+	int64_t num_arrived = 0;
+	int64_t last_timestamp = 0;
+	int64_t last_released_timestamp = INT64_MIN;
+	bool clock_started = false;
+	Clock::time_point anchor_time;
+	int64_t anchor_timestamp = 0;
+	bool resyncing = false;
+	bool ended = false;
+	std::atomic<bool> stopped{ false };
+	size_t buffer_bytes = 0;
+	int memory_stream_id;
+	Live_stats stats;
+};
+
+/**
+ * @brief Sends a generated H.264 MPEG-TS stream with arrival jitter and lost datagrams to a local UDP port,
+ * receives it with Demuxer::init_live, and checks that every packet that comes out is intact and that
+ * the stream only continues after a loss on a key frame. Needs an H.264 encoder in FFmpeg
+ * @param port Local UDP port to use
+ * @return True if the check passed, false otherwise
+*/
+bool live_selftest(int port = 45004);
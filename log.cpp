@@ -0,0 +1,313 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "log.h"
+
+/**
+ * @brief Large enough for the multi-line messages we log, eg. the video format in the decoder
+*/
+const size_t max_message_length = 480;
+
+/**
+ * @brief Number of records per thread. When full, new messages are dropped rather than blocking the thread
+*/
+const size_t ring_capacity = 512;
+
+/**
+ * @brief How often the flusher looks for new messages, unless log_flush is called
+*/
+const std::chrono::milliseconds flush_interval(5);
+
+struct Log_record {
+	int64_t timestamp;
+	Log_level level;
+	uint32_t thread_index;
+	char message[max_message_length];
+};
+
+/**
+ * @brief Single-producer, single-consumer ring buffer. The producer is the thread owning it, the
+ * consumer is the flusher thread
+*/
+class Log_ring {
+public:
+	Log_ring(uint32_t thread_index) : thread_index(thread_index) {}
+
+	/**
+	 * @brief Gets the slot to write the next record to
+	 * @return Slot, or nullptr if the ring is full
+	*/
+	Log_record* begin_push() {
+		auto head_now = head.load(std::memory_order_relaxed);
+
+		if (head_now - tail.load(std::memory_order_acquire) >= ring_capacity) {
+			num_dropped.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		return &records[head_now % ring_capacity];
+	}
+
+	/**
+	 * @brief Publishes the record from begin_push to the consumer
+	*/
+	void end_push() {
+		head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	/**
+	 * @brief Moves all available records to the output vector
+	*/
+	void pop_all(std::vector<Log_record>& output) {
+		auto tail_now = tail.load(std::memory_order_relaxed);
+		auto head_now = head.load(std::memory_order_acquire);
+
+		for (; tail_now != head_now; tail_now++) {
+			output.push_back(records[tail_now % ring_capacity]);
+		}
+
+		tail.store(tail_now, std::memory_order_release);
+	}
+
+	bool empty() {
+		return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire);
+	}
+
+	const uint32_t thread_index;
+	std::atomic<uint64_t> num_dropped{ 0 };
+	/**
+	 * @brief Set when the owning thread exits. The ring is removed once it's empty
+	*/
+	std::atomic<bool> abandoned{ false };
+private:
+	std::atomic<size_t> head{ 0 };
+	std::atomic<size_t> tail{ 0 };
+	Log_record records[ring_capacity];
+};
+
+/**
+ * @brief Owns the rings of all threads and the flusher thread writing them to stdout
+*/
+class Log_backend {
+public:
+	Log_backend() {
+		flusher = std::thread(&Log_backend::run, this);
+	}
+
+	~Log_backend() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+
+		wake_flusher.notify_all();
+		flusher.join();
+	}
+
+	std::shared_ptr<Log_ring> create_ring() {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto ring = std::make_shared<Log_ring>(next_thread_index++);
+
+		rings.push_back(ring);
+
+		return ring;
+	}
+
+	void flush() {
+		std::unique_lock<std::mutex> lock(mutex);
+		auto request = ++num_flush_requests;
+
+		wake_flusher.notify_all();
+		flush_done.wait(lock, [this, request]() { return num_flushes_done >= request || stopping; });
+	}
+
+	std::atomic<Log_level> level{ Log_level::debug };
+private:
+	void run() {
+		std::vector<Log_record> batch;
+		std::vector<std::shared_ptr<Log_ring>> rings_now;
+		bool stop = false;
+
+		while (!stop) {
+			uint64_t flush_request;
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake_flusher.wait_for(lock, flush_interval, [this]() { return stopping || num_flush_requests > num_flushes_done; });
+				stop = stopping;
+				flush_request = num_flush_requests;
+				rings_now = rings;
+			}
+
+			batch.clear();
+
+			for (auto& ring : rings_now) {
+				ring->pop_all(batch);
+
+				auto num_dropped = ring->num_dropped.exchange(0, std::memory_order_relaxed);
+
+				if (num_dropped > 0) {
+					fprintf(stdout, "[warning] [T%u] %llu log messages dropped, ring buffer was full\n", ring->thread_index, static_cast<unsigned long long>(num_dropped));
+				}
+			}
+
+			// Each ring is ordered, but messages from different threads need sorting
+			std::stable_sort(batch.begin(), batch.end(), [](const Log_record& a, const Log_record& b) { return a.timestamp < b.timestamp; });
+
+			for (auto& record : batch) {
+				write_record(record);
+			}
+
+			if (!batch.empty()) {
+				fflush(stdout);
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+
+			std::erase_if(rings, [](const std::shared_ptr<Log_ring>& ring) { return ring->abandoned && ring->empty(); });
+			num_flushes_done = flush_request;
+			flush_done.notify_all();
+		}
+	}
+
+	void write_record(const Log_record& record) {
+		const char* level_names[] = { "trace", "debug", "info", "warning", "error" };
+		auto time_point = std::chrono::system_clock::time_point(std::chrono::system_clock::duration(record.timestamp));
+		auto seconds = std::chrono::system_clock::to_time_t(time_point);
+		auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(time_point.time_since_epoch()).count() % 1000;
+		std::tm local_time;
+
+#ifdef _WIN32
+		localtime_s(&local_time, &seconds);
+#else
+		localtime_r(&seconds, &local_time);
+#endif
+
+		fprintf(stdout, "%02d:%02d:%02d.%03d [%s] [T%u] %s\n", local_time.tm_hour, local_time.tm_min, local_time.tm_sec,
+			static_cast<int>(milliseconds), level_names[static_cast<int>(record.level)], record.thread_index, record.message);
+	}
+
+	std::mutex mutex;
+	std::condition_variable wake_flusher;
+	std::condition_variable flush_done;
+	std::vector<std::shared_ptr<Log_ring>> rings;
+	std::thread flusher;
+	uint32_t next_thread_index = 0;
+	uint64_t num_flush_requests = 0;
+	uint64_t num_flushes_done = 0;
+	bool stopping = false;
+};
+
+Log_backend& get_log_backend() {
+	static Log_backend log_backend;
+	return log_backend;
+}
+
+/**
+ * @brief Creates the ring of a thread on first use, and marks it abandoned when the thread exits
+*/
+class Log_ring_holder {
+public:
+	~Log_ring_holder() {
+		if (ring) {
+			ring->abandoned = true;
+		}
+	}
+
+	Log_ring* get() {
+		if (!ring) {
+			ring = get_log_backend().create_ring();
+		}
+
+		return ring.get();
+	}
+private:
+	std::shared_ptr<Log_ring> ring;
+};
+
+thread_local Log_ring_holder log_ring_holder;
+
+bool Log_rate_limiter::allow(int& num_suppressed) {
+	auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	auto start = window_start.load(std::memory_order_relaxed);
+
+	if (now - start >= 1000 && window_start.compare_exchange_strong(start, now, std::memory_order_relaxed)) {
+		num_in_window.store(0, std::memory_order_relaxed);
+	}
+
+	if (num_in_window.fetch_add(1, std::memory_order_relaxed) < max_per_second) {
+		num_suppressed = num_suppressed_total.exchange(0, std::memory_order_relaxed);
+		return true;
+	}
+
+	num_suppressed_total.fetch_add(1, std::memory_order_relaxed);
+
+	return false;
+}
+
+void set_log_level(Log_level level) {
+	get_log_backend().level.store(level, std::memory_order_relaxed);
+}
+
+bool log_enabled(Log_level level) {
+	return static_cast<int>(level) >= LOG_MIN_LEVEL
+		&& level >= get_log_backend().level.load(std::memory_order_relaxed)
+		&& level != Log_level::off;
+}
+
+void log_vwrite(Log_level level, int num_suppressed, const char* format, va_list args) {
+	auto record = log_ring_holder.get()->begin_push();
+
+	if (!record) {
+		return;
+	}
+
+	record->timestamp = std::chrono::system_clock::now().time_since_epoch().count();
+	record->level = level;
+	record->thread_index = log_ring_holder.get()->thread_index;
+
+	auto length = vsnprintf(record->message, max_message_length, format, args);
+	size_t end = std::min(static_cast<size_t>(std::max(length, 0)), max_message_length - 1);
+
+	if (num_suppressed > 0) {
+		snprintf(record->message + end, max_message_length - end, " (%d similar messages suppressed)", num_suppressed);
+	}
+
+	// Trailing newlines are added when writing
+	end = strlen(record->message);
+
+	while (end > 0 && record->message[end - 1] == '\n') {
+		record->message[--end] = '\0';
+	}
+
+	log_ring_holder.get()->end_push();
+}
+
+void log_write(Log_level level, const char* format, ...) {
+	va_list args;
+
+	va_start(args, format);
+	log_vwrite(level, 0, format, args);
+	va_end(args);
+}
+
+void log_write_limited(Log_level level, int num_suppressed, const char* format, ...) {
+	va_list args;
+
+	va_start(args, format);
+	log_vwrite(level, num_suppressed, format, args);
+	va_end(args);
+}
+
+void log_flush() {
+	get_log_backend().flush();
+}
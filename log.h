@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+enum class Log_level {
+	trace,
+	debug,
+	info,
+	warning,
+	error,
+	off
+};
+
+/**
+ * @brief Messages below this level are removed at compile time. Set it with eg. -DLOG_MIN_LEVEL=2
+ * to only keep info and above. The value is an index into Log_level
+*/
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 1
+#endif
+
+/**
+ * @brief Lets GCC and Clang check the arguments of printf-style functions against the format string.
+ * The parameters are the 1-based positions of the format string and of the first variadic argument.
+ * MSVC has no equivalent for plain functions, so it's empty there
+*/
+#if defined(__GNUC__) || defined(__clang__)
+#define LOG_PRINTF_FORMAT(format_index, first_arg_index) __attribute__((format(printf, format_index, first_arg_index)))
+#else
+#define LOG_PRINTF_FORMAT(format_index, first_arg_index)
+#endif
+
+/**
+ * @brief Limits a log call site to a number of messages per second. Use through the LOG_*_LIMITED macros
+*/
+class Log_rate_limiter {
+public:
+	Log_rate_limiter(int max_per_second) : max_per_second(max_per_second) {}
+
+	/**
+	 * @brief Checks if another message may be logged now
+	 * @param num_suppressed Out parameter. If allowed, the number of messages suppressed since the last allowed message
+	 * @return True if the message should be logged, false otherwise
+	*/
+	bool allow(int& num_suppressed);
+private:
+	const int max_per_second;
+	std::atomic<int64_t> window_start{ 0 };
+	std::atomic<int> num_in_window{ 0 };
+	std::atomic<int> num_suppressed_total{ 0 };
+};
+
+/**
+ * @brief Sets the runtime log level. Messages below it are dropped before formatting
+*/
+void set_log_level(Log_level level);
+
+/**
+ * @brief Checks the runtime log level. Also true only if the level is kept at compile time
+*/
+bool log_enabled(Log_level level);
+
+/**
+ * @brief Formats a message (printf style) and puts it in the ring buffer of the calling thread.
+ * Never blocks; if the ring buffer is full, the message is dropped and counted. Use the LOG_* macros
+ * rather than calling this directly
+*/
+void log_write(Log_level level, const char* format, ...) LOG_PRINTF_FORMAT(2, 3);
+
+/**
+ * @brief Same as log_write, but adds the number of suppressed messages if there were any
+*/
+void log_write_limited(Log_level level, int num_suppressed, const char* format, ...) LOG_PRINTF_FORMAT(3, 4);
+
+/**
+ * @brief Blocks until all messages logged before this call are written
+*/
+void log_flush();
+
+#define LOG_AT(level, ...) \
+	do { \
+		if constexpr (static_cast<int>(level) >= LOG_MIN_LEVEL) { \
+			if (log_enabled(level)) { \
+				log_write(level, __VA_ARGS__); \
+			} \
+		} \
+	} while (0)
+
+#define LOG_AT_LIMITED(level, max_per_second, ...) \
+	do { \
+		if constexpr (static_cast<int>(level) >= LOG_MIN_LEVEL) { \
+			static Log_rate_limiter log_rate_limiter(max_per_second); \
+			int log_num_suppressed = 0; \
+			if (log_enabled(level) && log_rate_limiter.allow(log_num_suppressed)) { \
+				log_write_limited(level, log_num_suppressed, __VA_ARGS__); \
+			} \
+		} \
+	} while (0)
+
+#define LOG_TRACE(...) LOG_AT(Log_level::trace, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(Log_level::debug, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(Log_level::info, __VA_ARGS__)
+#define LOG_WARNING(...) LOG_AT(Log_level::warning, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(Log_level::error, __VA_ARGS__)
+
+#define LOG_DEBUG_LIMITED(max_per_second, ...) LOG_AT_LIMITED(Log_level::debug, max_per_second, __VA_ARGS__)
+#define LOG_INFO_LIMITED(max_per_second, ...) LOG_AT_LIMITED(Log_level::info, max_per_second, __VA_ARGS__)
+#define LOG_WARNING_LIMITED(max_per_second, ...) LOG_AT_LIMITED(Log_level::warning, max_per_second, __VA_ARGS__)
+#define LOG_ERROR_LIMITED(max_per_second, ...) LOG_AT_LIMITED(Log_level::error, max_per_second, __VA_ARGS__)
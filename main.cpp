@@ -1,40 +1,106 @@
-﻿#include <iostream>
+﻿#include <cstdlib>
+#include <cstring>
 
+#include "async.h"
 #include "decoder.h"
 #include "demuxer.h"
+#include "live_input.h"
+#include "log.h"
+#include "memory_governor.h"
+#include "preroll.h"
+#include "probe_cache.h"
 #include "stream_info.h"
 #include "render.h"
+#include "video_output.h"
 
-int main()
+int main(int argc, char** argv)
 {
 	const char* input_file = R"(d:\downloads\Tutorial1.mp4)";
+	const char* probe_cache_file = "probe_cache.bin";
 
 	Stream_info stream_info;
 	Demuxer demuxer;
 	Packet_data packet_data;
 	Decoder decoder;
+	Probe_cache probe_cache;
+
+	// Eg. --memory-budget-mb 2048 --live-selftest. Without it, the budget is unlimited
+	if (argc > 2 && std::strcmp(argv[1], "--memory-budget-mb") == 0) {
+		Memory_governor::get().set_budget(std::strtoull(argv[2], nullptr, 10) * 1024 * 1024);
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (argc > 1 && std::strcmp(argv[1], "--atlas-benchmark") == 0) {
+		atlas_benchmark();
+		log_flush();
+		return 0;
+	}
+
+	if (argc > 1 && std::strcmp(argv[1], "--virtual-texture-benchmark") == 0) {
+		virtual_texture_benchmark();
+		log_flush();
+		return 0;
+	}
+
+	if (argc > 1 && std::strcmp(argv[1], "--async-selftest") == 0) {
+		bool passed = async_selftest();
+		log_flush();
+		return passed ? 0 : 1;
+	}
+
+	if (argc > 1 && std::strcmp(argv[1], "--format-change-selftest") == 0) {
+		bool passed = format_change_selftest();
+		log_flush();
+		return passed ? 0 : 1;
+	}
+
+	if (argc > 1 && std::strcmp(argv[1], "--preroll-selftest") == 0) {
+		bool passed = preroll_selftest();
+		log_flush();
+		return passed ? 0 : 1;
+	}
+
+	if (argc > 1 && std::strcmp(argv[1], "--probe-cache-selftest") == 0) {
+		bool passed = probe_cache_selftest();
+		log_flush();
+		return passed ? 0 : 1;
+	}
+
+	if (argc > 1 && std::strcmp(argv[1], "--live-selftest") == 0) {
+		bool passed = live_selftest();
+		log_flush();
+		return passed ? 0 : 1;
+	}
 
 	main_loop();
 	return 0;
 
-	if (!demuxer.init(input_file, &stream_info)) {
+	// A missing cache file is fine; it will be created when we save
+	probe_cache.load(probe_cache_file);
+
+	if (!demuxer.init(input_file, &stream_info, &probe_cache)) {
 		return -1;
 	}
 
+	probe_cache.save(probe_cache_file);
+
 	if (!decoder.init(stream_info)) {
 		return -1;
 	}
 
 	for (int i = 0; i < 100; i++) {
 		if (demuxer.demux(&packet_data)) {
-			std::cout << "Demuxing packet of size " << packet_data.size << std::endl;
+			LOG_TRACE("Demuxing packet of size %d", packet_data.size);
 			if (!decoder.decode(packet_data.data, packet_data.size)) {
-				std::cout << "Could not decode :(" << std::endl;
+				LOG_WARNING_LIMITED(10, "Could not decode :(");
 			}
 		}
 	}
 
-	std::cout << "Done" << std::endl;
+	LOG_INFO("Done");
+	Memory_governor::get().log_usage();
+	log_flush();
 
 	return 0;
 }
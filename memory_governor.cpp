@@ -0,0 +1,178 @@
+#include <algorithm>
+
+#include "log.h"
+#include "memory_governor.h"
+
+Memory_governor& Memory_governor::get() {
+	static Memory_governor memory_governor;
+	return memory_governor;
+}
+
+void Memory_governor::set_budget(size_t budget_bytes) {
+	std::lock_guard<std::mutex> lock(mutex);
+	budget = budget_bytes;
+}
+
+size_t Memory_governor::get_budget() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return budget;
+}
+
+int Memory_governor::register_stream(const std::string& name, Shrink_fn shrink) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto stream_id = next_stream_id++;
+
+	streams[stream_id].name = name;
+	streams[stream_id].shrink = shrink;
+
+	return stream_id;
+}
+
+void Memory_governor::unregister_stream(int stream_id) {
+	std::unique_lock<std::mutex> lock(mutex);
+	auto it = streams.find(stream_id);
+
+	if (it == streams.end()) {
+		return;
+	}
+
+	// The shrink function usually refers to the object being destroyed, so it must not be running
+	shrink_done.wait(lock, [&it]() { return it->second.num_shrinks_running == 0; });
+
+	used -= it->second.total;
+	streams.erase(it);
+}
+
+bool Memory_governor::reserve(int stream_id, Memory_category category, size_t bytes) {
+	// First try as is, then once more after asking the other streams to shrink
+	for (int attempt = 0; attempt < 2; attempt++) {
+		std::vector<std::pair<int, Shrink_fn>> candidates;
+		size_t bytes_needed;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = streams.find(stream_id);
+
+			if (it == streams.end()) {
+				LOG_ERROR("Reserving memory for unknown stream %d", stream_id);
+				return false;
+			}
+
+			if (used + bytes <= budget) {
+				used += bytes;
+				it->second.bytes[static_cast<int>(category)] += bytes;
+				it->second.total += bytes;
+				return true;
+			}
+
+			if (attempt > 0) {
+				break;
+			}
+
+			bytes_needed = used + bytes - budget;
+
+			// Largest users first
+			std::vector<std::pair<size_t, int>> candidate_ids;
+
+			for (auto& [id, entry] : streams) {
+				if (id != stream_id && entry.shrink) {
+					candidate_ids.push_back({ entry.total, id });
+				}
+			}
+
+			std::sort(candidate_ids.rbegin(), candidate_ids.rend());
+
+			for (auto& [total, id] : candidate_ids) {
+				streams[id].num_shrinks_running++;
+				candidates.push_back({ id, streams[id].shrink });
+			}
+		}
+
+		// Shrink functions release memory through the governor, so they can't be called with the lock held
+		size_t bytes_freed = 0;
+
+		for (auto& [id, shrink] : candidates) {
+			if (bytes_freed < bytes_needed) {
+				bytes_freed += shrink(bytes_needed - bytes_freed);
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			streams[id].num_shrinks_running--;
+		}
+
+		shrink_done.notify_all();
+	}
+
+	LOG_WARNING_LIMITED(1, "Memory budget exceeded: could not reserve %zu bytes for stream %d", bytes, stream_id);
+
+	return false;
+}
+
+void Memory_governor::release(int stream_id, Memory_category category, size_t bytes) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = streams.find(stream_id);
+
+	if (it == streams.end()) {
+		return;
+	}
+
+	auto& reserved = it->second.bytes[static_cast<int>(category)];
+
+	bytes = std::min(bytes, reserved);
+	reserved -= bytes;
+	it->second.total -= bytes;
+	used -= bytes;
+}
+
+void Memory_governor::transfer(int from_stream_id, int to_stream_id, Memory_category category, size_t bytes) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto from = streams.find(from_stream_id);
+	auto to = streams.find(to_stream_id);
+
+	if (from == streams.end() || to == streams.end() || from == to) {
+		return;
+	}
+
+	auto& reserved = from->second.bytes[static_cast<int>(category)];
+
+	bytes = std::min(bytes, reserved);
+	reserved -= bytes;
+	from->second.total -= bytes;
+	to->second.bytes[static_cast<int>(category)] += bytes;
+	to->second.total += bytes;
+}
+
+size_t Memory_governor::get_used() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return used;
+}
+
+std::vector<Memory_usage> Memory_governor::get_usage() {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<Memory_usage> usage;
+
+	for (auto& [id, entry] : streams) {
+		Memory_usage stream_usage = { id, entry.name, {}, entry.total };
+
+		std::copy(std::begin(entry.bytes), std::end(entry.bytes), std::begin(stream_usage.bytes));
+		usage.push_back(stream_usage);
+	}
+
+	return usage;
+}
+
+void Memory_governor::log_usage() {
+	const double mb = 1024.0 * 1024.0;
+	auto usage = get_usage();
+	auto budget_now = get_budget();
+
+	LOG_INFO("Memory used: %.1f MB of %.1f MB budget", get_used() / mb, budget_now == static_cast<size_t>(-1) ? 0.0 : budget_now / mb);
+
+	for (auto& stream_usage : usage) {
+		LOG_INFO("  %s: %.1f MB (surfaces %.1f, frame pool %.1f, queues %.1f, caches %.1f)", stream_usage.name.c_str(), stream_usage.total / mb,
+			stream_usage.bytes[static_cast<int>(Memory_category::decoder_surfaces)] / mb,
+			stream_usage.bytes[static_cast<int>(Memory_category::frame_pool)] / mb,
+			stream_usage.bytes[static_cast<int>(Memory_category::queue)] / mb,
+			stream_usage.bytes[static_cast<int>(Memory_category::cache)] / mb);
+	}
+}
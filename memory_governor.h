@@ -0,0 +1,121 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum class Memory_category {
+	decoder_surfaces,
+	frame_pool,
+	queue,
+	cache,
+	num_categories
+};
+
+/**
+ * @brief Memory used by one registered stream
+*/
+struct Memory_usage {
+	int stream_id;
+	std::string name;
+	size_t bytes[static_cast<int>(Memory_category::num_categories)];
+	size_t total;
+};
+
+/**
+ * @brief Called when memory is needed elsewhere. Should free up to the given number of bytes
+ * (and release them from the governor), and return the number of bytes actually freed
+*/
+typedef std::function<size_t(size_t)> Shrink_fn;
+
+/**
+ * @brief Process-wide memory budget. Decoder surfaces, frame pools, queues and caches reserve
+ * their memory here. When a reservation doesn't fit, other streams are asked to shrink (evict
+ * cached data, reduce queue depth); if that isn't enough, the reservation is refused, which
+ * makes eg. new sessions fail instead of the process running out of memory
+*/
+class Memory_governor {
+public:
+	/**
+	 * @brief The governor used by the whole process
+	*/
+	static Memory_governor& get();
+
+	/**
+	 * @brief Sets the budget. Existing reservations are kept even if they exceed it
+	 * @param budget_bytes Budget in bytes. The default is unlimited
+	*/
+	void set_budget(size_t budget_bytes);
+
+	size_t get_budget();
+
+	/**
+	 * @brief Registers a stream, or anything else using memory
+	 * @param name Name used when reporting usage
+	 * @param shrink Optional function called when memory is needed by other streams
+	 * @return Stream id, used in the other calls
+	*/
+	int register_stream(const std::string& name, Shrink_fn shrink = nullptr);
+
+	/**
+	 * @brief Releases all remaining reservations of the stream. Waits for running shrink calls to the stream to finish
+	 * @param stream_id Id from register_stream
+	*/
+	void unregister_stream(int stream_id);
+
+	/**
+	 * @brief Reserves memory for a stream. Other streams may be asked to shrink to make room
+	 * @param stream_id Id from register_stream
+	 * @param category What the memory is used for
+	 * @param bytes Number of bytes
+	 * @return True if reserved, false if it doesn't fit within the budget
+	*/
+	bool reserve(int stream_id, Memory_category category, size_t bytes);
+
+	/**
+	 * @brief Releases memory reserved with reserve
+	*/
+	void release(int stream_id, Memory_category category, size_t bytes);
+
+	/**
+	 * @brief Moves a reservation from one stream to another, eg. when a decoder goes into a pool. Always
+	 * succeeds, since the total doesn't change. Does nothing if either stream isn't registered
+	*/
+	void transfer(int from_stream_id, int to_stream_id, Memory_category category, size_t bytes);
+
+	/**
+	 * @brief Total reserved bytes
+	*/
+	size_t get_used();
+
+	/**
+	 * @brief Reserved bytes per stream
+	*/
+	std::vector<Memory_usage> get_usage();
+
+	/**
+	 * @brief Logs the usage of each stream
+	*/
+	void log_usage();
+private:
+	Memory_governor() {}
+
+	struct Stream_entry {
+		std::string name;
+		Shrink_fn shrink;
+		size_t bytes[static_cast<int>(Memory_category::num_categories)] = {};
+		size_t total = 0;
+		int num_shrinks_running = 0;
+	};
+
+	std::mutex mutex;
+	std::condition_variable shrink_done;
+	std::map<int, Stream_entry> streams;
+	int next_stream_id = 0;
+	size_t budget = static_cast<size_t>(-1);
+	size_t used = 0;
+};
@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <filesystem>
+
+#include "decoder_pool.h"
+#include "log.h"
+#include "memory_governor.h"
+#include "preroll.h"
+#include "test_stream.h"
+
+Preroll::Preroll(Decoder_pool& decoder_pool) : decoder_pool(decoder_pool) {
+	memory_stream_id = Memory_governor::get().register_stream("preroll queue", [this](size_t bytes_needed) { return shrink(bytes_needed); });
+}
+
+Preroll::~Preroll() {
+	if (preroll_thread.joinable()) {
+		preroll_thread.join();
+	}
+
+	// Before the result is destroyed, so shrink is no longer called
+	Memory_governor::get().unregister_stream(memory_stream_id);
+	decoder_pool.release(std::move(preroll_result.decoder));
+}
+
+bool Preroll::start(const char* input_file, Probe_cache* probe_cache) {
+	if (preroll_thread.joinable()) {
+		LOG_WARNING("Preroll is already running");
+		return false;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		given_up = false;
+		preroll_result = Preroll_result();
+	}
+
+	success = false;
+	queue_full = false;
+	preroll_thread = std::thread(&Preroll::run, this, std::string(input_file), probe_cache);
+
+	return true;
+}
+
+void Preroll::run(std::string input_file, Probe_cache* probe_cache) {
+	Packet_data packet_data;
+	auto& result = preroll_result;
+
+	result.demuxer = std::make_unique<Demuxer>();
+
+	if (!result.demuxer->init(input_file.c_str(), &result.stream_info, probe_cache)) {
+		return;
+	}
+
+	result.decoder = decoder_pool.acquire(result.stream_info);
+
+	if (!result.decoder) {
+		return;
+	}
+
+	result.decoder->set_frame_callback([this, &result](Decoded_frame& frame) {
+		// Reserve before taking the lock, since other streams may be asked to shrink
+		auto frame_bytes = frame.data.size();
+		bool reserved = Memory_governor::get().reserve(memory_stream_id, Memory_category::queue, frame_bytes);
+		std::lock_guard<std::mutex> lock(queue_mutex);
+
+		if (given_up) {
+			if (reserved) {
+				Memory_governor::get().release(memory_stream_id, Memory_category::queue, frame_bytes);
+			}
+
+			return;
+		}
+
+		// The frame is already decoded, so keep it even if it doesn't fit, but stop decoding more
+		if (reserved) {
+			queue_bytes += frame_bytes;
+		}
+		else {
+			queue_full = true;
+		}
+
+		result.frames.push_back(std::move(frame));
+	});
+
+	bool first_packet = true;
+	bool end_of_gop = true;
+
+	while (result.demuxer->demux(&packet_data)) {
+		// The next key frame starts the second GOP, or the queue is full. Keep the packet for the player to decode
+		if ((packet_data.is_key_frame && !first_packet) || queue_full) {
+			result.pending_packet.assign(packet_data.data, packet_data.data + packet_data.size);
+			result.pending_timestamp = packet_data.timestamp;
+			end_of_gop = !queue_full;
+			break;
+		}
+
+		if (!result.decoder->decode(packet_data.data, packet_data.size, packet_data.timestamp)) {
+			return;
+		}
+
+		first_packet = false;
+	}
+
+	// With B-frames, the parser holds back the last frames of the GOP until it sees more of the stream. End the
+	// stream to get them. The player continues at the key frame with a new parser, which finds the sequence
+	// headers there. Leading frames of an open GOP that refer to this GOP can't be decoded then, but closed GOPs
+	// are complete. When the queue is full, the GOP isn't done, so the player goes on with this parser instead
+	if (end_of_gop) {
+		if (!result.decoder->flush()) {
+			return;
+		}
+
+		if (!result.pending_packet.empty() && !result.decoder->reset(result.stream_info)) {
+			return;
+		}
+	}
+
+	// The frame callback refers to the result, which is moved to the player in finish
+	result.decoder->set_frame_callback(nullptr);
+	success = true;
+}
+
+bool Preroll::finish(Preroll_result& result) {
+	if (!preroll_thread.joinable()) {
+		return false;
+	}
+
+	preroll_thread.join();
+
+	std::lock_guard<std::mutex> lock(queue_mutex);
+
+	// The frames belong to the player from here on
+	Memory_governor::get().release(memory_stream_id, Memory_category::queue, queue_bytes);
+	queue_bytes = 0;
+
+	if (given_up) {
+		LOG_INFO("Preroll was given up to free memory");
+	}
+
+	if (!success || given_up) {
+		decoder_pool.release(std::move(preroll_result.decoder));
+		preroll_result = Preroll_result();
+		return false;
+	}
+
+	result = std::move(preroll_result);
+	preroll_result = Preroll_result();
+
+	return true;
+}
+
+size_t Preroll::shrink(size_t bytes_needed) {
+	std::deque<Decoded_frame> dropped_frames;
+	size_t bytes_freed;
+
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+
+		if (queue_bytes == 0) {
+			return 0;
+		}
+
+		// Dropping some frames would leave a gap before the pending packet, so give up the whole preroll
+		given_up = true;
+		queue_full = true;
+		dropped_frames.swap(preroll_result.frames);
+		bytes_freed = queue_bytes;
+		queue_bytes = 0;
+	}
+
+	Memory_governor::get().release(memory_stream_id, Memory_category::queue, bytes_freed);
+
+	return bytes_freed;
+}
+
+bool preroll_selftest() {
+	auto path = (std::filesystem::temp_directory_path() / "preroll_selftest.ts").string();
+	Test_stream test_stream;
+
+	// Three GOPs
+	test_stream.segments = { { 320, 240, 75 } };
+
+	if (!encode_test_stream(test_stream) || !write_test_stream(test_stream, path)) {
+		return false;
+	}
+
+	// The GOPs are closed, so the first GOP has the frames of the packets before the second key frame
+	auto second_key_frame = std::find_if(test_stream.packets.begin() + 1, test_stream.packets.end(),
+		[](const Test_packet& test_packet) { return test_packet.is_key_frame; });
+	auto num_gop_frames = static_cast<size_t>(second_key_frame - test_stream.packets.begin());
+	std::vector<long long> timestamps;
+	bool ok = false;
+
+	{
+		Decoder_pool decoder_pool;
+		Preroll preroll(decoder_pool);
+		Preroll_result result;
+		Packet_data packet_data;
+
+		if (preroll.start(path.c_str()) && preroll.finish(result)) {
+			for (auto& frame : result.frames) {
+				timestamps.push_back(frame.timestamp);
+			}
+
+			size_t num_prerolled_frames = timestamps.size();
+
+			// Continue like the player
+			result.decoder->set_frame_callback([&timestamps](Decoded_frame& frame) { timestamps.push_back(frame.timestamp); });
+
+			if (!result.pending_packet.empty()) {
+				result.decoder->decode(result.pending_packet.data(), static_cast<int>(result.pending_packet.size()), result.pending_timestamp);
+			}
+
+			while (result.demuxer->demux(&packet_data)) {
+				result.decoder->decode(packet_data.data, packet_data.size, packet_data.timestamp);
+			}
+
+			result.decoder->flush();
+			result.decoder->set_frame_callback(nullptr);
+			decoder_pool.release(std::move(result.decoder));
+
+			ok = num_prerolled_frames == num_gop_frames && timestamps.size() == test_stream.packets.size()
+				&& std::is_sorted(timestamps.begin(), timestamps.end())
+				&& std::adjacent_find(timestamps.begin(), timestamps.end()) == timestamps.end();
+
+			if (!ok) {
+				LOG_ERROR("Preroll had %zu of %zu frames of the first GOP, %zu of %zu frames in total%s", num_prerolled_frames,
+					num_gop_frames, timestamps.size(), test_stream.packets.size(),
+					std::is_sorted(timestamps.begin(), timestamps.end()) ? "" : ", timestamps out of order");
+			}
+		}
+	}
+
+	std::error_code ec;
+	std::filesystem::remove(path, ec);
+
+	LOG_INFO("Preroll test %s", ok ? "passed" : "failed");
+
+	return ok;
+}
\ No newline at end of file
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "decoder.h"
+#include "demuxer.h"
+#include "stream_info.h"
+
+class Decoder_pool;
+class Probe_cache;
+
+/**
+ * @brief Everything the player needs to continue with a prerolled item
+*/
+class Preroll_result {
+public:
+	std::unique_ptr<Demuxer> demuxer;
+	std::unique_ptr<Decoder> decoder;
+	Stream_info stream_info;
+	/**
+	 * @brief Frames of the first GOP, in display order
+	*/
+	std::deque<Decoded_frame> frames;
+	/**
+	 * @brief First packet after the first GOP. It's demuxed but not decoded, so decode it
+	 * before demuxing more. Empty if the item is shorter than one GOP. If the queue filled
+	 * up before the end of the GOP, this is the packet the preroll stopped at
+	*/
+	std::vector<unsigned char> pending_packet;
+	long long pending_timestamp = 0;
+};
+
+/**
+ * @brief Opens the next item in a playlist and decodes its first GOP on a background
+ * thread, while the current item plays. This way the switch to the next item is seamless.
+ * The queued frames are reserved with the memory governor. If the budget is exceeded, the
+ * preroll stops early and the rest of the GOP is left for the player to decode. If another
+ * stream needs the memory, the preroll is given up and the player opens the item itself
+*/
+class Preroll {
+public:
+	Preroll(Decoder_pool& decoder_pool);
+	~Preroll();
+
+	/**
+	 * @brief Starts prerolling the given file on a background thread
+	 * @param input_file Video file
+	 * @param probe_cache Optional probe cache, passed on to Demuxer::init
+	 * @return True if started, false if a preroll is already running
+	*/
+	bool start(const char* input_file, Probe_cache* probe_cache = nullptr);
+
+	/**
+	 * @brief Waits for the preroll to finish and hands over the result
+	 * @param result Filled by this function
+	 * @return True on success, false if the preroll failed or was never started
+	*/
+	bool finish(Preroll_result& result);
+private:
+	void run(std::string input_file, Probe_cache* probe_cache);
+	size_t shrink(size_t bytes_needed);
+	Decoder_pool& decoder_pool;
+	std::thread preroll_thread;
+	Preroll_result preroll_result;
+	bool success = false;
+	int memory_stream_id;
+	/**
+	 * @brief Guards the queued frames, queue_bytes and given_up, since shrink is called from other threads
+	*/
+	std::mutex queue_mutex;
+	size_t queue_bytes = 0;
+	std::atomic<bool> queue_full{ false };
+	bool given_up = false;
+};
+
+/**
+ * @brief Prerolls a generated stream with B-frames, then continues decoding it like the player. Checks that the
+ * preroll has all frames of the first GOP, and that no frames are lost or out of order at the switch. Needs an
+ * H.264 encoder in FFmpeg
+ * @return True if the check passed, false otherwise
+*/
+bool preroll_selftest();
@@ -0,0 +1,244 @@
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <tuple>
+
+#include "probe_cache.h"
+
+/**
+ * @brief Number of bytes hashed from the beginning and from the end of the file.
+ * The end is included since the moov atom of an MP4 file is often placed there
+*/
+const uint64_t hash_block_size = 64 * 1024;
+
+/**
+ * @brief Written first in the cache file. Bump the version when the file layout changes, or when cached values were wrong
+*/
+const char cache_file_magic[4] = { 'P', 'R', 'B', 'C' };
+const uint32_t cache_file_version = 4;
+
+bool Probe_key::operator<(const Probe_key& other) const {
+	return std::tie(path, file_size, modification_time, content_hash)
+		< std::tie(other.path, other.file_size, other.modification_time, other.content_hash);
+}
+
+/**
+ * @brief FNV-1a, see http://www.isthe.com/chongo/tech/comp/fnv/
+ * @param data Data pointer
+ * @param data_size Size of data
+ * @param hash Hash to continue from
+ * @return Updated hash
+*/
+uint64_t fnv1a(const unsigned char* data, size_t data_size, uint64_t hash) {
+	for (size_t i = 0; i < data_size; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+bool Probe_cache::make_key(const char* path, Probe_key& key) {
+	std::error_code ec;
+	std::filesystem::path file_path(path);
+
+	auto file_size = std::filesystem::file_size(file_path, ec);
+
+	if (ec) {
+		return false;
+	}
+
+	auto modification_time = std::filesystem::last_write_time(file_path, ec);
+
+	if (ec) {
+		return false;
+	}
+
+	std::ifstream file(file_path, std::ios::binary);
+
+	if (!file) {
+		return false;
+	}
+
+	std::vector<unsigned char> block(static_cast<size_t>(std::min(file_size, hash_block_size)));
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	file.read(reinterpret_cast<char*>(block.data()), block.size());
+	hash = fnv1a(block.data(), static_cast<size_t>(file.gcount()), hash);
+
+	if (file_size > hash_block_size) {
+		file.clear();
+		file.seekg(static_cast<std::streamoff>(file_size - block.size()));
+		file.read(reinterpret_cast<char*>(block.data()), block.size());
+		hash = fnv1a(block.data(), static_cast<size_t>(file.gcount()), hash);
+	}
+
+	key.path = std::filesystem::absolute(file_path, ec).string();
+	key.file_size = file_size;
+	key.modification_time = static_cast<int64_t>(modification_time.time_since_epoch().count());
+	key.content_hash = hash;
+
+	return true;
+}
+
+bool Probe_cache::find(const Probe_key& key, Probe_result& result) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto it = entries.find(key);
+
+	if (it == entries.end()) {
+		return false;
+	}
+
+	result = it->second;
+
+	return true;
+}
+
+void Probe_cache::store(const Probe_key& key, const Probe_result& result) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// Only keep the latest version of each file
+	std::erase_if(entries, [&key](const auto& entry) { return entry.first.path == key.path; });
+
+	entries[key] = result;
+}
+
+template<typename T>
+void write_value(std::ofstream& file, const T& value) {
+	file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template<typename T>
+bool read_value(std::ifstream& file, T& value) {
+	return static_cast<bool>(file.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+void write_bytes(std::ofstream& file, const void* data, uint32_t data_size) {
+	write_value(file, data_size);
+	file.write(static_cast<const char*>(data), data_size);
+}
+
+template<typename T>
+bool read_bytes(std::ifstream& file, T& container) {
+	uint32_t data_size = 0;
+
+	if (!read_value(file, data_size)) {
+		return false;
+	}
+
+	container.resize(data_size);
+
+	return static_cast<bool>(file.read(reinterpret_cast<char*>(container.data()), data_size));
+}
+
+bool Probe_cache::load(const char* cache_file) {
+	std::ifstream file(cache_file, std::ios::binary);
+
+	if (!file) {
+		return false;
+	}
+
+	char magic[4];
+	uint32_t version = 0;
+	uint32_t num_entries = 0;
+
+	file.read(magic, sizeof(magic));
+
+	if (!file || !std::equal(std::begin(magic), std::end(magic), std::begin(cache_file_magic))) {
+		return false;
+	}
+
+	if (!read_value(file, version) || version != cache_file_version || !read_value(file, num_entries)) {
+		return false;
+	}
+
+	std::map<Probe_key, Probe_result> loaded_entries;
+
+	for (uint32_t i = 0; i < num_entries; i++) {
+		Probe_key key;
+		Probe_result result;
+		int codec_id, pixel_format;
+
+		bool ok = read_bytes(file, key.path)
+			&& read_value(file, key.file_size)
+			&& read_value(file, key.modification_time)
+			&& read_value(file, key.content_hash)
+			&& read_bytes(file, result.format_name)
+			&& read_value(file, codec_id)
+			&& read_value(file, pixel_format)
+			&& read_value(file, result.stream_info.width)
+			&& read_value(file, result.stream_info.height)
+			&& read_value(file, result.stream_info.bits_per_raw_pixel)
+			&& read_value(file, result.stream_info.time_base_num)
+			&& read_value(file, result.stream_info.time_base_den)
+			&& read_value(file, result.stream_info.frame_rate_num)
+			&& read_value(file, result.stream_info.frame_rate_den)
+			&& read_value(file, result.stream_info.start_time)
+			&& read_value(file, result.idx_video_stream)
+			&& read_value(file, result.codec_id)
+			&& read_value(file, result.format)
+			&& read_value(file, result.width)
+			&& read_value(file, result.height)
+			&& read_value(file, result.bits_per_raw_sample)
+			&& read_value(file, result.profile)
+			&& read_value(file, result.level)
+			&& read_bytes(file, result.extradata);
+
+		if (!ok) {
+			return false;
+		}
+
+		result.stream_info.codec_id = static_cast<Codec_id>(codec_id);
+		result.stream_info.pixel_format = static_cast<Pixel_format>(pixel_format);
+		loaded_entries[key] = result;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	entries.merge(loaded_entries);
+
+	return true;
+}
+
+bool Probe_cache::save(const char* cache_file) {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::ofstream file(cache_file, std::ios::binary | std::ios::trunc);
+
+	if (!file) {
+		return false;
+	}
+
+	file.write(cache_file_magic, sizeof(cache_file_magic));
+	write_value(file, cache_file_version);
+	write_value(file, static_cast<uint32_t>(entries.size()));
+
+	for (auto& [key, result] : entries) {
+		write_bytes(file, key.path.data(), static_cast<uint32_t>(key.path.size()));
+		write_value(file, key.file_size);
+		write_value(file, key.modification_time);
+		write_value(file, key.content_hash);
+		write_bytes(file, result.format_name.data(), static_cast<uint32_t>(result.format_name.size()));
+		write_value(file, static_cast<int>(result.stream_info.codec_id));
+		write_value(file, static_cast<int>(result.stream_info.pixel_format));
+		write_value(file, result.stream_info.width);
+		write_value(file, result.stream_info.height);
+		write_value(file, result.stream_info.bits_per_raw_pixel);
+		write_value(file, result.stream_info.time_base_num);
+		write_value(file, result.stream_info.time_base_den);
+		write_value(file, result.stream_info.frame_rate_num);
+		write_value(file, result.stream_info.frame_rate_den);
+		write_value(file, result.stream_info.start_time);
+		write_value(file, result.idx_video_stream);
+		write_value(file, result.codec_id);
+		write_value(file, result.format);
+		write_value(file, result.width);
+		write_value(file, result.height);
+		write_value(file, result.bits_per_raw_sample);
+		write_value(file, result.profile);
+		write_value(file, result.level);
+		write_bytes(file, result.extradata.data(), static_cast<uint32_t>(result.extradata.size()));
+	}
+
+	return static_cast<bool>(file);
+}
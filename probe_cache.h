@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "stream_info.h"
+
+/**
+ * @brief Identifies a file on disk. A cached probe result is only used if all
+ * of these match, so a file that is replaced or modified is probed again
+*/
+struct Probe_key {
+	std::string path;
+	uint64_t file_size;
+	int64_t modification_time;
+	/**
+	 * @brief Hash of the first and last part of the file. See make_key
+	*/
+	uint64_t content_hash;
+
+	bool operator<(const Probe_key& other) const;
+};
+
+/**
+ * @brief Everything needed to open a previously seen file without running
+ * avformat_find_stream_info. The codec parameter fields use the FFmpeg enum
+ * values (AVCodecID, AVPixelFormat) stored as plain integers
+*/
+struct Probe_result {
+	Stream_info stream_info;
+	/**
+	 * @brief Short name of the input format, so format probing can be skipped as well
+	*/
+	std::string format_name;
+	int idx_video_stream;
+	int codec_id;
+	int format;
+	int width;
+	int height;
+	int bits_per_raw_sample;
+	int profile;
+	int level;
+	std::vector<unsigned char> extradata;
+};
+
+/**
+ * @brief Cache of probe results, keyed by file identity. Opt-in; pass an instance
+ * to Demuxer::init to use it. Can be persisted between runs with load and save
+*/
+class Probe_cache {
+public:
+	Probe_cache() {}
+
+	/**
+	 * @brief Creates a key for the given file
+	 * @param path Path to the file
+	 * @param key Out parameter, filled by this function
+	 * @return True on success, false if the file can't be read
+	*/
+	static bool make_key(const char* path, Probe_key& key);
+
+	/**
+	 * @brief Looks up a cached result
+	 * @param key File key, see make_key
+	 * @param result Out parameter, filled on a hit
+	 * @return True on a cache hit, false otherwise
+	*/
+	bool find(const Probe_key& key, Probe_result& result);
+
+	/**
+	 * @brief Adds or replaces a cached result. Older entries for the same path are removed
+	 * @param key File key, see make_key
+	 * @param result Probe result to store
+	*/
+	void store(const Probe_key& key, const Probe_result& result);
+
+	/**
+	 * @brief Reads cache entries from file. Entries already in the cache are kept
+	 * @param cache_file File written by save
+	 * @return True on success, false if the file is missing or invalid
+	*/
+	bool load(const char* cache_file);
+
+	/**
+	 * @brief Writes all cache entries to file
+	 * @param cache_file File to write
+	 * @return True on success, false otherwise
+	*/
+	bool save(const char* cache_file);
+private:
+	std::mutex mutex;
+	std::map<Probe_key, Probe_result> entries;
+};
@@ -0,0 +1,513 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+#include <libswscale/swscale.h>
+}
+
+#include "decoder_pool.h"
+#include "log.h"
+#include "proxy.h"
+
+std::string get_proxy_path(const std::string& source_path) {
+	return source_path + ".proxy.mp4";
+}
+
+/**
+ * @brief Scales decoded NV12 frames to the proxy size, encodes them and writes them to an MP4 file
+*/
+class Proxy_encoder {
+public:
+	Proxy_encoder() {}
+	~Proxy_encoder();
+
+	/**
+	 * @brief Opens the encoder and the output file
+	 * @param path Output file
+	 * @param settings Proxy settings
+	 * @param stream_info Source stream. Timestamps are passed on in its time base
+	 * @param width Proxy width
+	 * @param height Proxy height
+	 * @return True on success, false otherwise
+	*/
+	bool open(const std::string& path, const Proxy_settings& settings, const Stream_info& stream_info, int width, int height);
+
+	/**
+	 * @brief Scales and encodes a frame
+	 * @param decoded_frame Frame from the decoder
+	 * @return True on success, false otherwise
+	*/
+	bool encode(const Decoded_frame& decoded_frame);
+
+	/**
+	 * @brief Flushes the encoder and finishes the file
+	 * @return True on success, false otherwise
+	*/
+	bool close();
+private:
+	bool write_packets();
+	AVFormatContext* format_context = nullptr;
+	AVCodecContext* codec_context = nullptr;
+	AVStream* stream = nullptr;
+	AVFrame* frame = nullptr;
+	AVPacket* packet = nullptr;
+	SwsContext* sws_context = nullptr;
+	unsigned int source_width = 0;
+	unsigned int source_height = 0;
+	bool header_written = false;
+};
+
+Proxy_encoder::~Proxy_encoder() {
+	if (format_context) {
+		if (!(format_context->oformat->flags & AVFMT_NOFILE)) {
+			avio_closep(&format_context->pb);
+		}
+
+		avformat_free_context(format_context);
+	}
+
+	avcodec_free_context(&codec_context);
+	av_frame_free(&frame);
+	av_packet_free(&packet);
+	sws_freeContext(sws_context);
+}
+
+bool Proxy_encoder::open(const std::string& path, const Proxy_settings& settings, const Stream_info& stream_info, int width, int height) {
+	const AVCodec* codec = nullptr;
+
+	for (auto& encoder_name : settings.encoder_names) {
+		if ((codec = avcodec_find_encoder_by_name(encoder_name.c_str()))) {
+			break;
+		}
+	}
+
+	if (!codec) {
+		LOG_ERROR("No H.264 encoder found for proxies");
+		return false;
+	}
+
+	if (avformat_alloc_output_context2(&format_context, nullptr, "mp4", path.c_str()) < 0) {
+		LOG_ERROR("Could not create output context for %s", path.c_str());
+		return false;
+	}
+
+	codec_context = avcodec_alloc_context3(codec);
+	frame = av_frame_alloc();
+	packet = av_packet_alloc();
+
+	if (!codec_context || !frame || !packet) {
+		LOG_ERROR("Could not allocate encoder");
+		return false;
+	}
+
+	AVRational time_base = { stream_info.time_base_num, stream_info.time_base_den };
+
+	if (time_base.num <= 0 || time_base.den <= 0) {
+		time_base = { 1, 90000 };
+	}
+
+	codec_context->width = width;
+	codec_context->height = height;
+	codec_context->pix_fmt = AV_PIX_FMT_YUV420P;
+	codec_context->time_base = time_base;
+	codec_context->framerate = { stream_info.frame_rate_num, stream_info.frame_rate_den };
+	codec_context->gop_size = settings.gop_size;
+	codec_context->max_b_frames = 0;
+	codec_context->bit_rate = settings.bit_rate;
+	// Assets are encoded in parallel, so one thread per encoder is enough
+	codec_context->thread_count = 1;
+
+	// Not all encoders have these options, so the return values are ignored
+	av_opt_set(codec_context->priv_data, "preset", "veryfast", 0);
+	av_opt_set(codec_context->priv_data, "tune", "fastdecode", 0);
+
+	if (format_context->oformat->flags & AVFMT_GLOBALHEADER) {
+		codec_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+	}
+
+	if (avcodec_open2(codec_context, codec, nullptr) < 0) {
+		LOG_ERROR("Could not open encoder %s", codec->name);
+		return false;
+	}
+
+	stream = avformat_new_stream(format_context, nullptr);
+
+	if (!stream || avcodec_parameters_from_context(stream->codecpar, codec_context) < 0) {
+		LOG_ERROR("Could not create output stream");
+		return false;
+	}
+
+	stream->time_base = time_base;
+
+	frame->format = codec_context->pix_fmt;
+	frame->width = width;
+	frame->height = height;
+
+	if (av_frame_get_buffer(frame, 0) < 0) {
+		LOG_ERROR("Could not allocate proxy frame");
+		return false;
+	}
+
+	if (avio_open(&format_context->pb, path.c_str(), AVIO_FLAG_WRITE) < 0) {
+		LOG_ERROR("Could not open %s for writing", path.c_str());
+		return false;
+	}
+
+	if (avformat_write_header(format_context, nullptr) < 0) {
+		LOG_ERROR("Could not write header to %s", path.c_str());
+		return false;
+	}
+
+	header_written = true;
+
+	return true;
+}
+
+bool Proxy_encoder::encode(const Decoded_frame& decoded_frame) {
+	if (!sws_context || decoded_frame.width != source_width || decoded_frame.height != source_height) {
+		sws_freeContext(sws_context);
+		sws_context = sws_getContext(decoded_frame.width, decoded_frame.height, AV_PIX_FMT_NV12,
+			frame->width, frame->height, AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
+		source_width = decoded_frame.width;
+		source_height = decoded_frame.height;
+	}
+
+	if (!sws_context || av_frame_make_writable(frame) < 0) {
+		return false;
+	}
+
+	// The chroma plane follows the luma plane, see display_callback_proc
+	const uint8_t* source_planes[] = { decoded_frame.data.data(), decoded_frame.data.data() + decoded_frame.pitch * decoded_frame.height };
+	const int source_strides[] = { static_cast<int>(decoded_frame.pitch), static_cast<int>(decoded_frame.pitch) };
+
+	sws_scale(sws_context, source_planes, source_strides, 0, decoded_frame.height, frame->data, frame->linesize);
+	frame->pts = decoded_frame.timestamp;
+
+	if (avcodec_send_frame(codec_context, frame) < 0) {
+		return false;
+	}
+
+	return write_packets();
+}
+
+bool Proxy_encoder::write_packets() {
+	while (true) {
+		auto ret = avcodec_receive_packet(codec_context, packet);
+
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+			return true;
+		}
+
+		if (ret < 0) {
+			return false;
+		}
+
+		av_packet_rescale_ts(packet, codec_context->time_base, stream->time_base);
+		packet->stream_index = stream->index;
+
+		if (av_interleaved_write_frame(format_context, packet) < 0) {
+			return false;
+		}
+	}
+}
+
+bool Proxy_encoder::close() {
+	if (!header_written) {
+		return false;
+	}
+
+	// A null frame flushes the encoder
+	bool ok = (avcodec_send_frame(codec_context, nullptr) >= 0) && write_packets();
+
+	header_written = false;
+	ok = (av_write_trailer(format_context) >= 0) && ok;
+
+	// Close the file now, so it can be renamed or removed
+	if (!(format_context->oformat->flags & AVFMT_NOFILE)) {
+		avio_closep(&format_context->pb);
+	}
+
+	return ok;
+}
+
+/**
+ * @brief Removes a partially written file when it goes out of scope, unless it was kept
+*/
+struct Partial_file_guard {
+	std::string path;
+	bool keep = false;
+
+	~Partial_file_guard() {
+		if (!keep) {
+			std::error_code ec;
+			std::filesystem::remove(path, ec);
+		}
+	}
+};
+
+Proxy_generator::Proxy_generator(Decoder_pool& decoder_pool, const Proxy_settings& settings, unsigned int num_workers)
+	: decoder_pool(decoder_pool), settings(settings), num_workers(num_workers) {
+	if (this->num_workers == 0) {
+		this->num_workers = std::max(1u, std::thread::hardware_concurrency());
+	}
+}
+
+Proxy_generator::~Proxy_generator() {
+	for (auto& worker_thread : workers) {
+		worker_thread.join();
+	}
+}
+
+bool Proxy_generator::start(const std::vector<std::string>& source_paths) {
+	if (!workers.empty()) {
+		LOG_WARNING("Proxy generation is already running");
+		return false;
+	}
+
+	jobs.clear();
+
+	for (auto& source_path : source_paths) {
+		if (std::filesystem::exists(get_proxy_path(source_path))) {
+			LOG_DEBUG("Proxy for %s already exists", source_path.c_str());
+			continue;
+		}
+
+		jobs.push_back(source_path);
+	}
+
+	idx_next_job = 0;
+	total_stats = Proxy_stats();
+	start_time = std::chrono::steady_clock::now();
+
+	auto num_threads = std::min(static_cast<size_t>(num_workers), jobs.size());
+
+	for (size_t i = 0; i < num_threads; i++) {
+		workers.emplace_back(&Proxy_generator::worker, this);
+	}
+
+	return true;
+}
+
+Proxy_stats Proxy_generator::wait() {
+	for (auto& worker_thread : workers) {
+		worker_thread.join();
+	}
+
+	workers.clear();
+
+	std::lock_guard<std::mutex> lock(stats_mutex);
+
+	total_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+	if (total_stats.num_assets > 0) {
+		LOG_INFO("Created %d proxies in %.2f s: %lld frames (%.1f fps, %.1f MB/s of source)", total_stats.num_assets,
+			total_stats.seconds, static_cast<long long>(total_stats.num_frames), total_stats.num_frames / total_stats.seconds,
+			total_stats.source_bytes / total_stats.seconds / (1024 * 1024));
+	}
+
+	return total_stats;
+}
+
+void Proxy_generator::worker() {
+	size_t idx_job;
+
+	while ((idx_job = idx_next_job++) < jobs.size()) {
+		Proxy_stats stats;
+
+		if (!create_proxy(jobs[idx_job], stats)) {
+			LOG_ERROR("Could not create proxy for %s", jobs[idx_job].c_str());
+			continue;
+		}
+
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		total_stats.num_assets++;
+		total_stats.num_frames += stats.num_frames;
+		total_stats.source_bytes += stats.source_bytes;
+	}
+}
+
+bool Proxy_generator::create_proxy(const std::string& source_path, Proxy_stats& stats) {
+	auto proxy_path = get_proxy_path(source_path);
+	// Write to a temporary file, so a proxy that's being created is never used
+	auto partial_path = proxy_path + ".part";
+	auto start_time = std::chrono::steady_clock::now();
+	// Declared before the encoder, so the file is closed before it's removed on failure
+	Partial_file_guard partial_file{ partial_path };
+	Demuxer demuxer;
+	Stream_info stream_info;
+	Packet_data packet_data;
+	Proxy_encoder encoder;
+
+	if (!demuxer.init(source_path.c_str(), &stream_info)) {
+		return false;
+	}
+
+	// Keep the aspect ratio. Encoders want even sizes for 4:2:0
+	int width = std::min(settings.width, static_cast<int>(stream_info.width)) & ~1;
+	int height = static_cast<int>(std::lround(1.0 * width * stream_info.height / stream_info.width)) & ~1;
+
+	if (!encoder.open(partial_path, settings, stream_info, width, height)) {
+		return false;
+	}
+
+	auto decoder = decoder_pool.acquire(stream_info);
+
+	if (!decoder) {
+		return false;
+	}
+
+	bool ok = true;
+
+	decoder->set_frame_callback([&](const Decoded_frame& decoded_frame) {
+		ok = ok && encoder.encode(decoded_frame);
+		stats.num_frames++;
+	});
+
+	while (ok && demuxer.demux(&packet_data)) {
+		stats.source_bytes += packet_data.size;
+		decoder->decode(packet_data.data, packet_data.size, packet_data.timestamp);
+	}
+
+	decoder->flush();
+	decoder->set_frame_callback(nullptr);
+	decoder_pool.release(std::move(decoder));
+
+	ok = encoder.close() && ok;
+	stats.num_assets = 1;
+	stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+	if (!ok) {
+		return false;
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(partial_path, proxy_path, ec);
+
+	if (ec) {
+		LOG_ERROR("Could not rename %s to %s", partial_path.c_str(), proxy_path.c_str());
+		return false;
+	}
+
+	partial_file.keep = true;
+
+	LOG_INFO("Created proxy %s: %lld frames in %.2f s (%.1f fps, %.1f MB/s of source)", proxy_path.c_str(),
+		static_cast<long long>(stats.num_frames), stats.seconds, stats.num_frames / stats.seconds,
+		stats.source_bytes / stats.seconds / (1024 * 1024));
+
+	return true;
+}
+
+Scrubber::Scrubber(Decoder_pool& decoder_pool, std::chrono::milliseconds settle_delay) : decoder_pool(decoder_pool),
+	settle_delay(settle_delay) {}
+
+Scrubber::~Scrubber() {
+	close(source);
+	close(proxy);
+}
+
+bool Scrubber::open(const std::string& path, Input& input) {
+	input.demuxer = std::make_unique<Demuxer>();
+
+	if (!input.demuxer->init(path.c_str(), &input.stream_info)) {
+		input.demuxer.reset();
+		return false;
+	}
+
+	input.decoder = decoder_pool.acquire(input.stream_info);
+
+	if (!input.decoder) {
+		input.demuxer.reset();
+		return false;
+	}
+
+	return true;
+}
+
+void Scrubber::close(Input& input) {
+	if (input.decoder) {
+		decoder_pool.release(std::move(input.decoder));
+	}
+
+	input.demuxer.reset();
+}
+
+bool Scrubber::init(const std::string& source_path) {
+	close(source);
+	close(proxy);
+	settled = true;
+
+	if (!open(source_path, source)) {
+		return false;
+	}
+
+	auto proxy_path = get_proxy_path(source_path);
+
+	if (std::filesystem::exists(proxy_path) && !open(proxy_path, proxy)) {
+		LOG_WARNING("Could not open proxy %s, scrubbing will use the source", proxy_path.c_str());
+	}
+
+	return true;
+}
+
+bool Scrubber::scrub_to(double seconds, Decoded_frame& frame) {
+	last_seconds = seconds;
+	last_scrub_time = std::chrono::steady_clock::now();
+	// A frame from the source is already exact
+	settled = !proxy.decoder;
+
+	return frame_at(proxy.decoder ? proxy : source, seconds, frame);
+}
+
+bool Scrubber::poll(Decoded_frame& frame) {
+	if (settled || std::chrono::steady_clock::now() - last_scrub_time < settle_delay) {
+		return false;
+	}
+
+	settled = true;
+
+	return frame_at(source, last_seconds, frame);
+}
+
+bool Scrubber::frame_at(Input& input, double seconds, Decoded_frame& frame) {
+	auto& stream_info = input.stream_info;
+	Packet_data packet_data;
+	bool found = false;
+
+	if (!input.decoder || stream_info.time_base_num <= 0 || stream_info.time_base_den <= 0) {
+		return false;
+	}
+
+	// Demuxer::seek counts from the start of the stream, and so do the seconds here
+	auto target_timestamp = std::llround(seconds * stream_info.time_base_den / stream_info.time_base_num) + stream_info.start_time;
+
+	// The parser must not mix data from before and after the seek
+	if (!input.demuxer->seek(seconds) || !input.decoder->reset(stream_info)) {
+		return false;
+	}
+
+	input.decoder->set_frame_callback([&](Decoded_frame& decoded_frame) {
+		if (!found && decoded_frame.timestamp >= target_timestamp) {
+			frame = std::move(decoded_frame);
+			found = true;
+		}
+	});
+
+	while (!found && input.demuxer->demux(&packet_data)) {
+		input.decoder->decode(packet_data.data, packet_data.size, packet_data.timestamp);
+	}
+
+	if (!found) {
+		input.decoder->flush();
+	}
+
+	input.decoder->set_frame_callback(nullptr);
+
+	return found;
+}
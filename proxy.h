@@ -0,0 +1,144 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "decoder.h"
+#include "demuxer.h"
+#include "stream_info.h"
+
+class Decoder_pool;
+
+struct Proxy_settings {
+	/**
+	 * @brief Width of the proxy. The height follows from the aspect ratio of the source
+	*/
+	int width = 640;
+	/**
+	 * @brief Distance between key frames. 1 means all-intra, which makes every frame a cheap seek target
+	*/
+	int gop_size = 1;
+	int64_t bit_rate = 2000000;
+	/**
+	 * @brief Tried in order. The proxy must be H.264, so our decoder can play it
+	*/
+	std::vector<std::string> encoder_names = { "libx264", "h264_nvenc", "h264_mf" };
+};
+
+/**
+ * @brief Throughput of proxy generation, for one asset or all of them
+*/
+struct Proxy_stats {
+	int num_assets = 0;
+	int64_t num_frames = 0;
+	int64_t source_bytes = 0;
+	double seconds = 0;
+};
+
+/**
+ * @brief Path of the proxy for a source file
+*/
+std::string get_proxy_path(const std::string& source_path);
+
+/**
+ * @brief Creates low-resolution proxies of assets in the background, several assets in parallel.
+ * Each asset is demuxed and decoded with Demuxer and Decoder, scaled down and encoded with libavcodec
+*/
+class Proxy_generator {
+public:
+	/**
+	 * @param decoder_pool Pool to get decoders from
+	 * @param settings Proxy settings
+	 * @param num_workers Number of assets processed in parallel. 0 means one per hardware thread
+	*/
+	Proxy_generator(Decoder_pool& decoder_pool, const Proxy_settings& settings = {}, unsigned int num_workers = 0);
+	~Proxy_generator();
+
+	/**
+	 * @brief Starts creating proxies for the given files. Files that already have a proxy are skipped
+	 * @param source_paths Files to create proxies for
+	 * @return True if started, false if a previous run is still active
+	*/
+	bool start(const std::vector<std::string>& source_paths);
+
+	/**
+	 * @brief Waits for all proxies to be created, and logs the total throughput
+	 * @return Throughput of the run. The time is wall time since start
+	*/
+	Proxy_stats wait();
+private:
+	void worker();
+	bool create_proxy(const std::string& source_path, Proxy_stats& stats);
+	Decoder_pool& decoder_pool;
+	Proxy_settings settings;
+	unsigned int num_workers;
+	std::vector<std::string> jobs;
+	std::atomic<size_t> idx_next_job{ 0 };
+	std::vector<std::thread> workers;
+	std::chrono::steady_clock::time_point start_time;
+	std::mutex stats_mutex;
+	Proxy_stats total_stats;
+};
+
+/**
+ * @brief Gets frames for a scrub bar. While the user drags, frames come from the proxy if there is
+ * one. When the user stops, the exact frame is decoded from the source. The switch is made here, so
+ * callers only report the position and poll for the exact frame
+*/
+class Scrubber {
+public:
+	/**
+	 * @param settle_delay How long the position must stay the same before the exact frame is decoded
+	*/
+	Scrubber(Decoder_pool& decoder_pool, std::chrono::milliseconds settle_delay = std::chrono::milliseconds(200));
+	~Scrubber();
+
+	/**
+	 * @brief Opens the source, and its proxy if there is one
+	 * @param source_path Source file
+	 * @return True on success, false otherwise
+	*/
+	bool init(const std::string& source_path);
+
+	/**
+	 * @brief Gets the frame at the given time, for interactive scrubbing. Uses the proxy if there is one,
+	 * otherwise the source
+	 * @param seconds Time from the start of the stream
+	 * @param frame Filled by this function
+	 * @return True on success, false otherwise
+	*/
+	bool scrub_to(double seconds, Decoded_frame& frame);
+
+	/**
+	 * @brief Call regularly, eg. once per rendered frame. Once scrubbing has stopped for the settle delay,
+	 * decodes the frame at the last position from the source, once
+	 * @param frame Filled by this function if it returns true
+	 * @return True if there is a new frame from the source, false otherwise
+	*/
+	bool poll(Decoded_frame& frame);
+private:
+	struct Input {
+		std::unique_ptr<Demuxer> demuxer;
+		std::unique_ptr<Decoder> decoder;
+		Stream_info stream_info;
+	};
+
+	bool open(const std::string& path, Input& input);
+	void close(Input& input);
+	bool frame_at(Input& input, double seconds, Decoded_frame& frame);
+	Decoder_pool& decoder_pool;
+	Input source;
+	Input proxy;
+	std::chrono::milliseconds settle_delay;
+	std::chrono::steady_clock::time_point last_scrub_time;
+	double last_seconds = 0.0;
+	/**
+	 * @brief True when the last frame given out is exact, so there's nothing to do in poll
+	*/
+	bool settled = true;
+};
@@ -1,8 +1,15 @@
-#include <iostream>
+#include <chrono>
+#include <cmath>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#include <utility>
+#include <vector>
 
+#include "atlas.h"
+#include "decoder.h"
+#include "log.h"
 #include "render.h"
+#include "virtual_texture.h"
 
 unsigned int vao;
 unsigned int ebo;
@@ -11,6 +18,53 @@ unsigned int shader_program;
 bool key_state[GLFW_KEY_LAST]{};
 
 bool wireframes = false;
+
+unsigned int create_shader_program(const char* vertex_shader_source, const char* fragment_shader_source) {
+	unsigned int vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+	glShaderSource(vertex_shader, 1, &vertex_shader_source, nullptr);
+	glCompileShader(vertex_shader);
+
+	int  success;
+	char infoLog[512];
+	glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &success);
+
+	if (!success)
+	{
+		glGetShaderInfoLog(vertex_shader, 512, NULL, infoLog);
+		LOG_ERROR("ERROR::SHADER::VERTEX::COMPILATION_FAILED\n%s", infoLog);
+	}
+
+	unsigned int fragment_shader;
+	fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+	glShaderSource(fragment_shader, 1, &fragment_shader_source, NULL);
+	glCompileShader(fragment_shader);
+
+	glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &success);
+	if (!success)
+	{
+		glGetShaderInfoLog(fragment_shader, 512, NULL, infoLog);
+		LOG_ERROR("ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n%s", infoLog);
+	}
+
+	auto program = glCreateProgram();
+	glAttachShader(program, vertex_shader);
+	glAttachShader(program, fragment_shader);
+	glLinkProgram(program);
+
+	glDeleteShader(vertex_shader);
+	glDeleteShader(fragment_shader);
+
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	if (!success) {
+		glGetProgramInfoLog(program, 512, NULL, infoLog);
+		LOG_ERROR("ERROR::SHADER::PROGRAM::LINK_FAILED\n%s", infoLog);
+		glDeleteProgram(program);
+		return 0;
+	}
+
+	return program;
+}
+
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
 	glViewport(0, 0, width, height);
@@ -55,20 +109,6 @@ void init_triangle() {
 		"{\n"
 		"   gl_Position = vec4(aPos.x, aPos.y, aPos.z, 1.0);\n"
 		"}\0";
-	unsigned int vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-	glShaderSource(vertex_shader, 1, &vertex_shader_source, nullptr);
-	glCompileShader(vertex_shader);
-
-	int  success;
-	char infoLog[512];
-	glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &success);
-
-	if (!success)
-	{
-		glGetShaderInfoLog(vertex_shader, 512, NULL, infoLog);
-		std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
-	}
-
 	const char* fragment_shader_source = "#version 430 core\n"
 		"out vec4 FragColor;\n"
 		"uniform vec4 custom_color;"
@@ -79,32 +119,9 @@ void init_triangle() {
 		"	float dist = distance(pos, vec2(0.5, 0.5));\n"
 		"   FragColor = custom_color * vec4(gl_FragCoord.x/800, gl_FragCoord.y/600, dist, 1);\n"
 		"}\n";
-	unsigned int fragment_shader;
-	fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-	glShaderSource(fragment_shader, 1, &fragment_shader_source, NULL);
-	glCompileShader(fragment_shader);
-
-	glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &success);
-	if (!success)
-	{
-		glGetShaderInfoLog(fragment_shader, 512, NULL, infoLog);
-		std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
-	}
-
-	shader_program = glCreateProgram();
-	glAttachShader(shader_program, vertex_shader);
-	glAttachShader(shader_program, fragment_shader);
-	glLinkProgram(shader_program);
-
-	glGetProgramiv(shader_program, GL_LINK_STATUS, &success);
-	if (!success) {
-		glGetProgramInfoLog(shader_program, 512, NULL, infoLog);
-		std::cout << "ERROR::SHADER::PROGRAM::LINK_FAILED\n" << infoLog << std::endl;
-	}
 
+	shader_program = create_shader_program(vertex_shader_source, fragment_shader_source);
 	glUseProgram(shader_program);
-	glDeleteShader(vertex_shader);
-	glDeleteShader(fragment_shader);
 
 	unsigned int vbo;
 	glGenBuffers(1, &vbo);
@@ -151,28 +168,39 @@ void init() {
 	init_triangle();
 }
 
-void main_loop() {
-	int width = 800;
-	int height = 600;
-
+GLFWwindow* create_window(int width, int height, const char* title, bool visible) {
 	glfwInit();
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwWindowHint(GLFW_VISIBLE, visible ? GLFW_TRUE : GLFW_FALSE);
 
-	auto window = glfwCreateWindow(width, height, "Rendering window", nullptr, nullptr);
+	auto window = glfwCreateWindow(width, height, title, nullptr, nullptr);
 
 	if (!window) {
-		std::cout << "Could not create window" << std::endl;
+		LOG_ERROR("Could not create window");
 		glfwTerminate();
-		return;
+		return nullptr;
 	}
 
 	glfwMakeContextCurrent(window);
 
 	if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
 	{
-		std::cout << "Failed to initialize GLAD" << std::endl;
+		LOG_ERROR("Failed to initialize GLAD");
+		glfwTerminate();
+		return nullptr;
+	}
+
+	return window;
+}
+
+void main_loop() {
+	int width = 800;
+	int height = 600;
+	auto window = create_window(width, height, "Rendering window");
+
+	if (!window) {
 		return;
 	}
 
@@ -188,4 +216,196 @@ void main_loop() {
 	}
 
 	glfwTerminate();
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Makes an NV12 frame with a gradient that moves with the frame number
+*/
+void fill_test_frame(Decoded_frame& frame, int frame_number) {
+	auto chroma_plane = frame.data.data() + frame.pitch * frame.height;
+
+	for (unsigned int y = 0; y < frame.height; y++) {
+		for (unsigned int x = 0; x < frame.width; x++) {
+			frame.data[y * frame.pitch + x] = static_cast<unsigned char>(16 + (x + y + frame_number) % 220);
+		}
+	}
+
+	for (unsigned int y = 0; y < (frame.height + 1) / 2; y++) {
+		for (unsigned int x = 0; x < frame.width; x += 2) {
+			chroma_plane[y * frame.pitch + x] = static_cast<unsigned char>(128 + (y + frame_number) % 64);
+			chroma_plane[y * frame.pitch + x + 1] = static_cast<unsigned char>(128 - (x + frame_number) % 64);
+		}
+	}
+}
+
+void atlas_benchmark() {
+	const int width = 1920;
+	const int height = 1080;
+	const int num_frames = 120;
+	// Streams are replaced now and then, so the atlas fragments and has to repack
+	const int replace_interval = 10;
+	const int stream_counts[] = { 16, 64, 256 };
+	const int stream_sizes[][2] = { { 320, 180 }, { 256, 144 }, { 480, 270 } };
+	const int num_sizes = 3;
+
+	auto window = create_window(width, height, "Atlas benchmark", false);
+
+	if (!window) {
+		return;
+	}
+
+	glViewport(0, 0, width, height);
+	LOG_INFO("Atlas benchmark on %s", reinterpret_cast<const char*>(glGetString(GL_RENDERER)));
+
+	// One test frame per size, updated every frame
+	std::vector<Decoded_frame> frames(num_sizes);
+
+	for (int i = 0; i < num_sizes; i++) {
+		frames[i].width = stream_sizes[i][0];
+		frames[i].height = stream_sizes[i][1];
+		frames[i].pitch = stream_sizes[i][0];
+		frames[i].timestamp = 0;
+		frames[i].data.resize(frames[i].pitch * frames[i].height * 3 / 2);
+	}
+
+	for (auto num_streams : stream_counts) {
+		Texture_atlas atlas;
+
+		if (!atlas.init()) {
+			LOG_ERROR("Could not initialize texture atlas");
+			break;
+		}
+
+		std::vector<int> stream_ids(num_streams);
+		std::vector<int> size_indices(num_streams);
+		std::vector<Atlas_instance> instances(num_streams);
+		int num_columns = static_cast<int>(std::ceil(std::sqrt(num_streams)));
+		float cell_size = 2.0f / num_columns;
+
+		for (int i = 0; i < num_streams; i++) {
+			size_indices[i] = i % num_sizes;
+			stream_ids[i] = atlas.add_stream(stream_sizes[size_indices[i]][0], stream_sizes[size_indices[i]][1]);
+			instances[i] = { stream_ids[i], -1.0f + (i % num_columns) * cell_size, 1.0f - (i / num_columns + 1) * cell_size, cell_size, cell_size };
+		}
+
+		// The first upload and draw include one-time costs, so leave them out
+		atlas.upload();
+		glFinish();
+		atlas.get_stats();
+
+		std::chrono::duration<double> update_time{};
+		auto start_time = std::chrono::steady_clock::now();
+
+		for (int frame_number = 0; frame_number < num_frames; frame_number++) {
+			if (frame_number % replace_interval == replace_interval - 1) {
+				auto i = (frame_number * 7) % num_streams;
+
+				atlas.remove_stream(stream_ids[i]);
+				size_indices[i] = (size_indices[i] + 1) % num_sizes;
+				stream_ids[i] = atlas.add_stream(stream_sizes[size_indices[i]][0], stream_sizes[size_indices[i]][1]);
+				instances[i].stream_id = stream_ids[i];
+			}
+
+			auto update_start_time = std::chrono::steady_clock::now();
+
+			for (auto& frame : frames) {
+				fill_test_frame(frame, frame_number);
+			}
+
+			for (int i = 0; i < num_streams; i++) {
+				atlas.update(stream_ids[i], frames[size_indices[i]]);
+			}
+
+			update_time += std::chrono::steady_clock::now() - update_start_time;
+
+			glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+			glClear(GL_COLOR_BUFFER_BIT);
+			atlas.upload();
+			atlas.draw(instances);
+			glFinish();
+		}
+
+		std::chrono::duration<double> total_time = std::chrono::steady_clock::now() - start_time;
+		auto stats = atlas.get_stats();
+
+		LOG_INFO("%d streams: %.2f ms per frame (%.2f ms copying frames), %.1f upload calls and %.1f MB per frame, %.1f draw calls per frame, %d repacks",
+			num_streams, 1000.0 * total_time.count() / num_frames, 1000.0 * update_time.count() / num_frames,
+			static_cast<double>(stats.num_upload_calls) / num_frames, stats.upload_bytes / (1024.0 * 1024.0) / num_frames,
+			static_cast<double>(stats.num_draw_calls) / num_frames, stats.num_repacks);
+	}
+
+	glfwDestroyWindow(window);
+	glfwTerminate();
+}
+
+void virtual_texture_benchmark() {
+	const int width = 1920;
+	const int height = 1080;
+	const int num_warmup_frames = 5;
+	const int num_frames = 30;
+	const int frame_sizes[][2] = { { 3840, 2160 }, { 7680, 4320 }, { 15360, 4320 } };
+	const std::pair<const char*, Virtual_view> views[] = {
+		{ "full screen", { -1.0f, -1.0f, 2.0f, 2.0f } },
+		{ "zoomed in", { -1.0f, -1.0f, 2.0f, 2.0f, 0.4f, 0.4f, 0.1f, 0.1f } },
+		{ "thumbnail", { -0.2f, -0.2f, 0.4f, 0.4f } }
+	};
+
+	auto window = create_window(width, height, "Virtual texture benchmark", false);
+
+	if (!window) {
+		return;
+	}
+
+	glViewport(0, 0, width, height);
+	LOG_INFO("Virtual texture benchmark on %s", reinterpret_cast<const char*>(glGetString(GL_RENDERER)));
+
+	for (auto& frame_size : frame_sizes) {
+		Decoded_frame frame;
+
+		frame.width = frame_size[0];
+		frame.height = frame_size[1];
+		frame.pitch = frame_size[0];
+		frame.timestamp = 0;
+		frame.data.resize(static_cast<size_t>(frame.pitch) * frame.height * 3 / 2);
+		fill_test_frame(frame, 0);
+
+		double full_frame_mb = frame.width * static_cast<double>(frame.height) * 4 / (1024.0 * 1024.0);
+
+		for (auto& [view_name, view] : views) {
+			Virtual_texture virtual_texture;
+
+			if (!virtual_texture.init()) {
+				LOG_ERROR("Could not initialize virtual texture");
+				break;
+			}
+
+			std::chrono::steady_clock::time_point start_time;
+
+			// Every frame counts as new, so all visible tiles are converted and uploaded again, like with video
+			for (int frame_number = 0; frame_number < num_warmup_frames + num_frames; frame_number++) {
+				if (frame_number == num_warmup_frames) {
+					glFinish();
+					virtual_texture.get_stats();
+					start_time = std::chrono::steady_clock::now();
+				}
+
+				glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+				glClear(GL_COLOR_BUFFER_BIT);
+				virtual_texture.set_frame(frame);
+				virtual_texture.update(view, width, height);
+				virtual_texture.draw(view);
+				glFinish();
+			}
+
+			std::chrono::duration<double> total_time = std::chrono::steady_clock::now() - start_time;
+			auto stats = virtual_texture.get_stats();
+
+			LOG_INFO("%dx%d, %s: %.2f ms per frame, %.1f tiles and %.1f MB uploaded per frame (whole frame is %.1f MB), %d evictions",
+				frame.width, frame.height, view_name, 1000.0 * total_time.count() / num_frames, static_cast<double>(stats.num_tiles_uploaded) / num_frames,
+				stats.upload_bytes / (1024.0 * 1024.0) / num_frames, full_frame_mb, stats.num_evictions);
+		}
+	}
+
+	glfwDestroyWindow(window);
+	glfwTerminate();
+}
@@ -1,3 +1,32 @@
 #pragma once
 
-void main_loop();
\ No newline at end of file
+struct GLFWwindow;
+
+/**
+ * @brief Compiles and links a shader program. Errors are logged
+ * @return The program, or 0 on failure
+*/
+unsigned int create_shader_program(const char* vertex_shader_source, const char* fragment_shader_source);
+
+/**
+ * @brief Creates a window with an OpenGL 4.3 core context, and makes the context current.
+ * Initializes GLFW and GLAD
+ * @param visible False for offscreen rendering, eg. benchmarks
+ * @return The window, or nullptr on failure
+*/
+GLFWwindow* create_window(int width, int height, const char* title, bool visible = true);
+
+void main_loop();
+
+/**
+ * @brief Measures texture atlas compositing with 16, 64 and 256 streams of synthetic frames,
+ * in a hidden window. This is not headless: GLFW needs a display for the window, so use Xvfb on a
+ * machine without one. To run on llvmpipe, set LIBGL_ALWAYS_SOFTWARE=1
+*/
+void atlas_benchmark();
+
+/**
+ * @brief Measures virtual texturing of 4K, 8K and 16K panoramic frames, full screen, zoomed in and as a
+ * thumbnail, in a hidden window. Logs how much is uploaded per frame compared to the whole frame
+*/
+void virtual_texture_benchmark();
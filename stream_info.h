@@ -24,4 +24,18 @@ struct Stream_info {
 	unsigned int width;
 	unsigned int height;
 	unsigned int bits_per_raw_pixel;
+	/**
+	 * @brief Unit of packet and frame timestamps, in seconds
+	*/
+	int time_base_num;
+	int time_base_den;
+	/**
+	 * @brief Average frame rate. Can be 0/0 if unknown
+	*/
+	int frame_rate_num;
+	int frame_rate_den;
+	/**
+	 * @brief Timestamp of the first frame, in the time base. 0 if unknown
+	*/
+	long long start_time;
 };
\ No newline at end of file
@@ -0,0 +1,271 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+}
+
+#include "log.h"
+#include "test_stream.h"
+
+bool encode_test_frames(const Test_segment& segment, int frame_rate, long long first_pts, const AVCodec* codec,
+	AVCodecContext* codec_context, AVFrame* frame, AVPacket* packet, std::vector<Test_packet>& packets) {
+	codec_context->width = segment.width;
+	codec_context->height = segment.height;
+	codec_context->pix_fmt = AV_PIX_FMT_YUV420P;
+	codec_context->time_base = { 1, frame_rate };
+	codec_context->framerate = { frame_rate, 1 };
+	codec_context->gop_size = frame_rate;
+	codec_context->max_b_frames = 2;
+	codec_context->bit_rate = 1000000;
+	// Not all encoders have this option, so the return value is ignored
+	av_opt_set(codec_context->priv_data, "preset", "veryfast", 0);
+
+	if (avcodec_open2(codec_context, codec, nullptr) < 0) {
+		LOG_ERROR("Could not open encoder %s", codec->name);
+		return false;
+	}
+
+	frame->format = codec_context->pix_fmt;
+	frame->width = segment.width;
+	frame->height = segment.height;
+
+	if (av_frame_get_buffer(frame, 0) < 0) {
+		LOG_ERROR("Could not allocate test frame");
+		return false;
+	}
+
+	for (int i = 0; i <= segment.num_frames; i++) {
+		if (i < segment.num_frames) {
+			auto frame_number = first_pts + i;
+
+			if (av_frame_make_writable(frame) < 0) {
+				return false;
+			}
+
+			for (int y = 0; y < segment.height; y++) {
+				for (int x = 0; x < segment.width; x++) {
+					frame->data[0][y * frame->linesize[0] + x] = static_cast<uint8_t>(x + y * 2 + frame_number * 4);
+				}
+			}
+
+			for (int y = 0; y < segment.height / 2; y++) {
+				memset(frame->data[1] + y * frame->linesize[1], static_cast<int>(128 + frame_number % 64), segment.width / 2);
+				memset(frame->data[2] + y * frame->linesize[2], static_cast<int>(128 - frame_number % 64), segment.width / 2);
+			}
+
+			frame->pts = frame_number;
+		}
+
+		// A null frame flushes the encoder
+		if (avcodec_send_frame(codec_context, i < segment.num_frames ? frame : nullptr) < 0) {
+			return false;
+		}
+
+		while (avcodec_receive_packet(codec_context, packet) >= 0) {
+			packets.push_back({ std::vector<unsigned char>(packet->data, packet->data + packet->size), packet->pts, packet->dts,
+				(packet->flags & AV_PKT_FLAG_KEY) != 0 });
+			av_packet_unref(packet);
+		}
+	}
+
+	return true;
+}
+
+/**
+ * @brief Encodes one segment with an encoder of its own, so it gets its own sequence headers
+*/
+bool encode_test_segment(const Test_segment& segment, int frame_rate, long long first_pts, std::vector<Test_packet>& packets) {
+	const char* encoder_names[] = { "libx264", "h264_nvenc", "h264_mf" };
+	const AVCodec* codec = nullptr;
+
+	for (auto encoder_name : encoder_names) {
+		if ((codec = avcodec_find_encoder_by_name(encoder_name))) {
+			break;
+		}
+	}
+
+	if (!codec) {
+		LOG_ERROR("No H.264 encoder found for the test stream");
+		return false;
+	}
+
+	AVCodecContext* codec_context = avcodec_alloc_context3(codec);
+	AVFrame* frame = av_frame_alloc();
+	AVPacket* packet = av_packet_alloc();
+	bool ok = false;
+
+	if (codec_context && frame && packet) {
+		ok = encode_test_frames(segment, frame_rate, first_pts, codec, codec_context, frame, packet, packets);
+	}
+	else {
+		LOG_ERROR("Could not allocate encoder");
+	}
+
+	avcodec_free_context(&codec_context);
+	av_frame_free(&frame);
+	av_packet_free(&packet);
+
+	return ok;
+}
+
+bool encode_test_stream(Test_stream& test_stream) {
+	long long next_pts = 0;
+
+	test_stream.packets.clear();
+
+	for (auto& segment : test_stream.segments) {
+		std::vector<Test_packet> segment_packets;
+
+		if (!encode_test_segment(segment, test_stream.frame_rate, next_pts, segment_packets) || segment_packets.empty()) {
+			return false;
+		}
+
+		// With B-frames, the encoder starts decode timestamps before the first presentation timestamp. Shift the
+		// segment so decode timestamps don't go below zero or back to before the previous segment
+		long long min_dts = test_stream.packets.empty() ? 0 : test_stream.packets.back().dts + 1;
+		long long shift = std::max(0LL, min_dts - segment_packets.front().dts);
+
+		for (auto& test_packet : segment_packets) {
+			test_packet.pts += shift;
+			test_packet.dts += shift;
+			next_pts = std::max(next_pts, test_packet.pts + 1);
+			test_stream.packets.push_back(std::move(test_packet));
+		}
+	}
+
+	return true;
+}
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+int write_test_data(void* opaque, const uint8_t* data, int size) {
+#else
+int write_test_data(void* opaque, uint8_t* data, int size) {
+#endif
+	auto ts_data = static_cast<std::vector<unsigned char>*>(opaque);
+
+	ts_data->insert(ts_data->end(), data, data + size);
+
+	return size;
+}
+
+bool write_test_packets(const Test_stream& test_stream, AVFormatContext* format_context, AVPacket* packet,
+	std::vector<unsigned char>& ts_data, std::vector<size_t>* packet_ends) {
+	const AVRational time_base = { 1, test_stream.frame_rate };
+	auto stream = avformat_new_stream(format_context, nullptr);
+
+	if (!stream) {
+		LOG_ERROR("Could not create output stream");
+		return false;
+	}
+
+	stream->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+	stream->codecpar->codec_id = AV_CODEC_ID_H264;
+	stream->codecpar->width = test_stream.segments.front().width;
+	stream->codecpar->height = test_stream.segments.front().height;
+	stream->time_base = { 1, 90000 };
+
+	if (avformat_write_header(format_context, nullptr) < 0) {
+		LOG_ERROR("Could not start the test stream");
+		return false;
+	}
+
+	for (auto& test_packet : test_stream.packets) {
+		if (av_new_packet(packet, static_cast<int>(test_packet.data.size())) < 0) {
+			return false;
+		}
+
+		memcpy(packet->data, test_packet.data.data(), test_packet.data.size());
+		packet->pts = test_packet.pts;
+		packet->dts = test_packet.dts;
+		packet->flags = test_packet.is_key_frame ? AV_PKT_FLAG_KEY : 0;
+		packet->stream_index = stream->index;
+		av_packet_rescale_ts(packet, time_base, stream->time_base);
+
+		if (av_interleaved_write_frame(format_context, packet) < 0) {
+			return false;
+		}
+
+		// So the end of the packet is known
+		avio_flush(format_context->pb);
+
+		if (packet_ends) {
+			packet_ends->push_back(ts_data.size());
+		}
+	}
+
+	if (av_write_trailer(format_context) < 0) {
+		return false;
+	}
+
+	avio_flush(format_context->pb);
+
+	return true;
+}
+
+bool mux_test_stream(const Test_stream& test_stream, std::vector<unsigned char>& ts_data, std::vector<size_t>* packet_ends,
+	const char* format_name) {
+	AVFormatContext* format_context = nullptr;
+
+	if (test_stream.segments.empty() || avformat_alloc_output_context2(&format_context, nullptr, format_name, nullptr) < 0) {
+		LOG_ERROR("Could not create %s muxer", format_name);
+		return false;
+	}
+
+	const int io_buffer_size = 4096;
+	auto io_buffer = static_cast<unsigned char*>(av_malloc(io_buffer_size));
+
+	if (io_buffer) {
+		format_context->pb = avio_alloc_context(io_buffer, io_buffer_size, 1, &ts_data, nullptr, write_test_data, nullptr);
+	}
+
+	AVPacket* packet = av_packet_alloc();
+	bool ok = false;
+
+	ts_data.clear();
+
+	if (packet_ends) {
+		packet_ends->clear();
+	}
+
+	if (format_context->pb && packet) {
+		ok = write_test_packets(test_stream, format_context, packet, ts_data, packet_ends);
+	}
+	else {
+		LOG_ERROR("Could not allocate muxer");
+	}
+
+	if (format_context->pb) {
+		av_freep(&format_context->pb->buffer);
+		avio_context_free(&format_context->pb);
+	}
+	else {
+		av_free(io_buffer);
+	}
+
+	avformat_free_context(format_context);
+	av_packet_free(&packet);
+
+	return ok;
+}
+
+bool write_test_stream(const Test_stream& test_stream, const std::string& path, const char* format_name) {
+	std::vector<unsigned char> ts_data;
+
+	if (!mux_test_stream(test_stream, ts_data, nullptr, format_name)) {
+		return false;
+	}
+
+	std::ofstream file(path, std::ios::binary);
+
+	if (!file.write(reinterpret_cast<const char*>(ts_data.data()), ts_data.size())) {
+		LOG_ERROR("Could not write %s", path.c_str());
+		return false;
+	}
+
+	return true;
+}
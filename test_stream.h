@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Part of a test stream with one frame size. Each segment starts with a key frame and new sequence headers
+*/
+struct Test_segment {
+	int width;
+	int height;
+	int num_frames;
+};
+
+/**
+ * @brief An encoded H.264 packet, in Annex B format
+*/
+struct Test_packet {
+	std::vector<unsigned char> data;
+	/**
+	 * @brief Timestamps in frames
+	*/
+	long long pts;
+	long long dts;
+	bool is_key_frame;
+};
+
+/**
+ * @brief Generated H.264 stream for the selftests: a moving test pattern with a key frame every second, and B-frames
+*/
+struct Test_stream {
+	int frame_rate = 25;
+	std::vector<Test_segment> segments;
+	/**
+	 * @brief Filled by encode_test_stream, in decode order. Decode timestamps increase over the whole stream
+	*/
+	std::vector<Test_packet> packets;
+};
+
+/**
+ * @brief Encodes the segments of the test stream. Needs an H.264 encoder in FFmpeg
+ * @param test_stream Stream with the segments set. The packets are filled by this function
+ * @return True on success, false otherwise
+*/
+bool encode_test_stream(Test_stream& test_stream);
+
+/**
+ * @brief Muxes the encoded test stream, to MPEG-TS by default. MPEG-TS carries the sequence headers in band, so
+ * the frame size can change between segments
+ * @param test_stream Encoded stream
+ * @param ts_data Filled by this function
+ * @param packet_ends Optional, filled with the end of the data of each packet in ts_data
+ * @param format_name Short name of the output format. Must be one that can be written without seeking, eg. "matroska"
+ * @return True on success, false otherwise
+*/
+bool mux_test_stream(const Test_stream& test_stream, std::vector<unsigned char>& ts_data, std::vector<size_t>* packet_ends = nullptr,
+	const char* format_name = "mpegts");
+
+/**
+ * @brief Muxes the encoded test stream to a file. See mux_test_stream
+ * @return True on success, false otherwise
+*/
+bool write_test_stream(const Test_stream& test_stream, const std::string& path, const char* format_name = "mpegts");
@@ -0,0 +1,197 @@
+#include <filesystem>
+#include <string>
+#include <utility>
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include "atlas.h"
+#include "demuxer.h"
+#include "log.h"
+#include "memory_governor.h"
+#include "render.h"
+#include "stream_info.h"
+#include "test_stream.h"
+#include "video_output.h"
+#include "virtual_texture.h"
+
+Video_output::Video_output(Decoder& decoder, int width, int height, Texture_atlas* atlas, Virtual_texture* virtual_texture)
+	: decoder(decoder), atlas(atlas), virtual_texture(virtual_texture), width(width), height(height) {
+	memory_stream_id = Memory_governor::get().register_stream("video output");
+
+	if (atlas) {
+		atlas_stream_id = atlas->add_stream(width, height);
+
+		if (atlas_stream_id < 0) {
+			LOG_WARNING("No space in the atlas for a %dx%d stream", width, height);
+		}
+	}
+
+	if (virtual_texture) {
+		virtual_texture->set_frame_size(width, height);
+	}
+
+	decoder.set_format_callback([this](const Frame_format& format) { on_format(format); });
+	decoder.set_frame_callback([this](Decoded_frame& frame) { on_frame(frame); });
+}
+
+Video_output::~Video_output() {
+	decoder.set_frame_callback(nullptr);
+	decoder.set_format_callback(nullptr);
+
+	if (atlas && atlas_stream_id >= 0) {
+		atlas->remove_stream(atlas_stream_id);
+	}
+
+	Memory_governor::get().unregister_stream(memory_stream_id);
+}
+
+void Video_output::on_format(const Frame_format& format) {
+	stats.num_format_changes++;
+	width = format.width;
+	height = format.height;
+
+	if (atlas && atlas_stream_id >= 0 && !atlas->resize_stream(atlas_stream_id, width, height)) {
+		LOG_WARNING("Could not resize atlas stream %d to %ux%u", atlas_stream_id, width, height);
+		stats.num_resize_failures++;
+	}
+
+	if (virtual_texture) {
+		virtual_texture->set_frame_size(width, height);
+	}
+}
+
+void Video_output::on_frame(Decoded_frame& frame) {
+	stats.num_frames++;
+
+	if (frame.width != width || frame.height != height) {
+		LOG_WARNING_LIMITED(10, "Frame is %ux%u, but the last format change was to %ux%u", frame.width, frame.height, width, height);
+		stats.num_mismatched_frames++;
+	}
+
+	if (atlas && atlas_stream_id >= 0) {
+		atlas->update(atlas_stream_id, frame);
+	}
+
+	if (virtual_texture) {
+		auto& governor = Memory_governor::get();
+		auto frame_bytes = frame.data.capacity();
+
+		// Whoever holds a buffer has it reserved, so the decoder releases the buffer it hands over and reserves the one it gets back
+		if (!governor.reserve(memory_stream_id, Memory_category::frame_pool, frame_bytes)) {
+			LOG_WARNING_LIMITED(1, "Not showing frame in the virtual texture, no memory budget for it");
+			return;
+		}
+
+		// Swapped rather than copied, so the decoder gets the previous buffer back to decode into
+		std::swap(latest_frame, frame);
+		governor.release(memory_stream_id, Memory_category::frame_pool, latest_frame_bytes);
+		latest_frame_bytes = frame_bytes;
+		virtual_texture->set_frame(latest_frame);
+	}
+}
+
+/**
+ * @brief Decodes the file into the atlas and virtual texture, drawing both after every packet
+*/
+bool decode_format_change_test_stream(const std::string& path, const Test_stream& test_stream, GLFWwindow* window,
+	int window_width, int window_height, Video_output_stats& stats) {
+	auto& last_segment = test_stream.segments.back();
+	Demuxer demuxer;
+	Stream_info stream_info;
+	Packet_data packet_data;
+	Decoder decoder;
+	Texture_atlas atlas;
+	Virtual_texture virtual_texture;
+	const Virtual_view view = { -1.0f, -1.0f, 1.0f, 2.0f };
+
+	if (!demuxer.init(path.c_str(), &stream_info) || !atlas.init() || !virtual_texture.init()) {
+		return false;
+	}
+
+	// The decoder isn't grown mid-stream, so give it room for the last segment, rounded up to whole macroblocks
+	if (!decoder.init(stream_info, (last_segment.width + 15) & ~15, (last_segment.height + 15) & ~15)) {
+		return false;
+	}
+
+	Video_output output(decoder, stream_info.width, stream_info.height, &atlas, &virtual_texture);
+
+	if (output.get_atlas_stream_id() < 0) {
+		return false;
+	}
+
+	const std::vector<Atlas_instance> instances = { { output.get_atlas_stream_id(), 0.0f, -1.0f, 1.0f, 2.0f } };
+
+	auto draw = [&]() {
+		glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+		glClear(GL_COLOR_BUFFER_BIT);
+		atlas.upload();
+		atlas.draw(instances);
+		virtual_texture.update(view, window_width, window_height);
+		virtual_texture.draw(view);
+		glfwSwapBuffers(window);
+	};
+
+	while (demuxer.demux(&packet_data)) {
+		decoder.decode(packet_data.data, packet_data.size, packet_data.timestamp);
+		draw();
+	}
+
+	decoder.flush();
+	draw();
+	glFinish();
+
+	stats = output.get_stats();
+
+	return true;
+}
+
+bool format_change_selftest() {
+	const int width = 1280;
+	const int height = 720;
+	auto path = (std::filesystem::temp_directory_path() / "format_change_selftest.ts").string();
+	Test_stream test_stream;
+	Video_output_stats stats;
+
+	test_stream.segments = { { 320, 240, 50 }, { 640, 360, 50 } };
+
+	if (!encode_test_stream(test_stream) || !write_test_stream(test_stream, path)) {
+		return false;
+	}
+
+	auto window = create_window(width, height, "Format change selftest", false);
+
+	if (!window) {
+		return false;
+	}
+
+	glViewport(0, 0, width, height);
+
+	bool decoded = decode_format_change_test_stream(path, test_stream, window, width, height, stats);
+
+	glfwDestroyWindow(window);
+	glfwTerminate();
+
+	std::error_code ec;
+	std::filesystem::remove(path, ec);
+
+	if (!decoded) {
+		LOG_ERROR("Could not decode the format change test stream");
+		return false;
+	}
+
+	int num_frames = 0;
+
+	for (auto& segment : test_stream.segments) {
+		num_frames += segment.num_frames;
+	}
+
+	// The first segment has the size of the stream info, so only the switch is a format change
+	bool ok = stats.num_frames == num_frames && stats.num_format_changes == 1 && stats.num_mismatched_frames == 0
+		&& stats.num_resize_failures == 0;
+
+	LOG_INFO("Format change test %s: %d of %d frames, %d format changes, %d frames of the wrong size, %d failed resizes",
+		ok ? "passed" : "failed", stats.num_frames, num_frames, stats.num_format_changes, stats.num_mismatched_frames,
+		stats.num_resize_failures);
+
+	return ok;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "decoder.h"
+
+class Texture_atlas;
+class Virtual_texture;
+
+/**
+ * @brief Counters since the video output was created
+*/
+struct Video_output_stats {
+	int num_frames = 0;
+	int num_format_changes = 0;
+	/**
+	 * @brief Frames that didn't have the size of the last format change. Stays 0 as long as the
+	 * format callback comes before the first frame in the new size
+	*/
+	int num_mismatched_frames = 0;
+	/**
+	 * @brief Format changes the atlas stream couldn't be resized for. It keeps its old size then, and frames are cut off
+	*/
+	int num_resize_failures = 0;
+};
+
+/**
+ * @brief Shows the frames of a decoder in a texture atlas stream, a virtual texture, or both. When the
+ * stream changes size mid-stream, the decoder's format callback resizes the atlas stream and the virtual
+ * texture before the first frame in the new size arrives. The callbacks use OpenGL, so decode on the
+ * thread with the context
+*/
+class Video_output {
+public:
+	/**
+	 * @param decoder Decoder to show. Its frame and format callbacks are set while this object exists
+	 * @param width Frame width at the start of the stream
+	 * @param height Frame height at the start of the stream
+	 * @param atlas Optional atlas to copy the frames into. A stream is added for this output
+	 * @param virtual_texture Optional virtual texture to show the latest frame with
+	*/
+	Video_output(Decoder& decoder, int width, int height, Texture_atlas* atlas, Virtual_texture* virtual_texture = nullptr);
+	~Video_output();
+	Video_output(const Video_output&) = delete;
+	Video_output& operator=(const Video_output&) = delete;
+
+	/**
+	 * @brief Stream of this output in the atlas, or -1 if there is no atlas or it didn't fit
+	*/
+	int get_atlas_stream_id() { return atlas_stream_id; }
+
+	Video_output_stats get_stats() { return stats; }
+private:
+	void on_format(const Frame_format& format);
+	void on_frame(Decoded_frame& frame);
+	Decoder& decoder;
+	Texture_atlas* atlas;
+	Virtual_texture* virtual_texture;
+	int atlas_stream_id = -1;
+	unsigned int width;
+	unsigned int height;
+	/**
+	 * @brief Latest frame, for the virtual texture, which reads it in update. Reserved on memory_stream_id
+	*/
+	Decoded_frame latest_frame;
+	size_t latest_frame_bytes = 0;
+	int memory_stream_id;
+	Video_output_stats stats;
+};
+
+/**
+ * @brief Decodes a generated stream that switches from 320x240 to 640x360 halfway, into a texture atlas
+ * and a virtual texture in a hidden window. Checks that the format callback resizes both before the first
+ * frame in the new size, and that no frames are lost. Needs an H.264 encoder in FFmpeg
+ * @return True if the check passed, false otherwise
+*/
+bool format_change_selftest();
@@ -0,0 +1,722 @@
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <glad/glad.h>
+
+#include "decoder.h"
+#include "log.h"
+#include "memory_governor.h"
+#include "render.h"
+#include "virtual_texture.h"
+
+/**
+ * @brief The feedback pass renders at this fraction of the viewport size in each direction
+*/
+const int feedback_scale = 8;
+/**
+ * @brief Size of the level_offsets uniform array. A macro, so the shader can be built with it
+*/
+#define VIRTUAL_TEXTURE_MAX_LEVELS 16
+#define VIRTUAL_TEXTURE_STRINGIFY(value) #value
+#define VIRTUAL_TEXTURE_TO_STRING(value) VIRTUAL_TEXTURE_STRINGIFY(value)
+const int max_levels = VIRTUAL_TEXTURE_MAX_LEVELS;
+/**
+ * @brief The feedback is read back through a ring of pixel buffers, and used a frame or two later, when
+ * the GPU is done with it. Reading it right away would stall until the GPU has finished the frame
+*/
+const int num_feedback_buffers = 3;
+/**
+ * @brief The tile cache isn't shrunk below this many slots in each direction
+*/
+const int min_slots_per_row = 4;
+
+const char* virtual_texture_vertex_shader_source = "#version 430 core\n"
+	"layout (location = 0) in vec2 corner;\n"
+	"uniform vec4 screen_rect;\n"
+	"uniform vec4 uv_rect;\n"
+	"out vec2 uv;\n"
+	"void main()\n"
+	"{\n"
+	"	gl_Position = vec4(screen_rect.xy + corner * screen_rect.zw, 0.0, 1.0);\n"
+	"	// Rows are stored top down\n"
+	"	uv = vec2(uv_rect.x + corner.x * uv_rect.z, uv_rect.y + (1.0 - corner.y) * uv_rect.w);\n"
+	"}\n";
+
+/**
+ * @brief Shared by the feedback and draw passes, so both pick the same tiles
+*/
+#define VIRTUAL_TEXTURE_TILE_LOOKUP \
+	"uniform ivec2 frame_size;\n" \
+	"uniform int tile_payload;\n" \
+	"uniform int num_levels;\n" \
+	"uniform float lod_bias;\n" \
+	"in vec2 uv;\n" \
+	"vec2 get_texel()\n" \
+	"{\n" \
+	"	return min(clamp(uv, 0.0, 1.0) * vec2(frame_size), vec2(frame_size) - 0.5);\n" \
+	"}\n" \
+	"int get_level(vec2 texel)\n" \
+	"{\n" \
+	"	// Frame pixels per screen pixel\n" \
+	"	float footprint = max(length(dFdx(texel)), length(dFdy(texel)));\n" \
+	"	float lod = log2(max(footprint, 1e-6)) + lod_bias;\n" \
+	"	return int(clamp(floor(lod + 0.5), 0.0, float(num_levels - 1)));\n" \
+	"}\n" \
+	"ivec2 get_tile(vec2 texel, int level)\n" \
+	"{\n" \
+	"	return ivec2(texel) / (tile_payload << level);\n" \
+	"}\n"
+
+const char* virtual_texture_feedback_shader_source = "#version 430 core\n"
+	VIRTUAL_TEXTURE_TILE_LOOKUP
+	"out uvec4 feedback;\n"
+	"void main()\n"
+	"{\n"
+	"	vec2 texel = get_texel();\n"
+	"	int level = get_level(texel);\n"
+	"	// The last component marks the pixel as covered\n"
+	"	feedback = uvec4(get_tile(texel, level), level, 1);\n"
+	"}\n";
+
+const char* virtual_texture_fragment_shader_source = "#version 430 core\n"
+	VIRTUAL_TEXTURE_TILE_LOOKUP
+	"uniform sampler2D tile_cache;\n"
+	"uniform usampler2D indirection;\n"
+	"uniform int level_offsets[" VIRTUAL_TEXTURE_TO_STRING(VIRTUAL_TEXTURE_MAX_LEVELS) "];\n"
+	"uniform int tile_size;\n"
+	"uniform float cache_size;\n"
+	"out vec4 frag_color;\n"
+	"void main()\n"
+	"{\n"
+	"	vec2 texel = get_texel();\n"
+	"	int level = get_level(texel);\n"
+	"	ivec2 tile = get_tile(texel, level);\n"
+	"	// Slot of the tile, or of the closest coarser tile that is resident, and the level of that tile\n"
+	"	uvec4 entry = texelFetch(indirection, ivec2(tile.x, level_offsets[level] + tile.y), 0);\n"
+	"	vec2 level_texel = texel / float(1 << entry.z);\n"
+	"	vec2 tile_texel = level_texel - floor(level_texel / float(tile_payload)) * float(tile_payload);\n"
+	"	vec2 cache_texel = vec2(entry.xy) * float(tile_size) + 1.0 + tile_texel;\n"
+	"	frag_color = texture(tile_cache, cache_texel / cache_size);\n"
+	"}\n";
+
+Virtual_texture::Virtual_texture(int tile_size, int cache_size, int max_uploads_per_frame) : tile_size(tile_size), tile_payload(tile_size - 2),
+	cache_size(cache_size), slots_per_row(cache_size / tile_size), max_uploads_per_frame(max_uploads_per_frame) {
+	// Backwards, so slots are handed out from the start
+	for (int slot = slots_per_row * slots_per_row - 1; slot >= 0; slot--) {
+		free_slots.push_back(slot);
+	}
+
+	tile_pixels.resize(static_cast<size_t>(tile_size) * tile_size * 4);
+}
+
+Virtual_texture::~Virtual_texture() {
+	if (draw_program) {
+		glDeleteProgram(draw_program);
+		glDeleteProgram(feedback_program);
+		glDeleteVertexArrays(1, &vao);
+		glDeleteBuffers(1, &vbo);
+		glDeleteTextures(1, &cache_texture);
+	}
+
+	if (indirection_texture) {
+		glDeleteTextures(1, &indirection_texture);
+	}
+
+	if (feedback_framebuffer) {
+		glDeleteFramebuffers(1, &feedback_framebuffer);
+		glDeleteTextures(1, &feedback_texture);
+	}
+
+	discard_feedback();
+
+	for (auto& feedback_buffer : feedback_buffers) {
+		glDeleteBuffers(1, &feedback_buffer.pbo);
+	}
+
+	if (memory_stream_id >= 0) {
+		Memory_governor::get().unregister_stream(memory_stream_id);
+	}
+}
+
+size_t get_cache_bytes(int cache_size) {
+	return static_cast<size_t>(cache_size) * cache_size * 4;
+}
+
+bool Virtual_texture::init() {
+	memory_stream_id = Memory_governor::get().register_stream("virtual texture", [this](size_t bytes_needed) { return shrink(bytes_needed); });
+
+	if (!Memory_governor::get().reserve(memory_stream_id, Memory_category::cache, get_cache_bytes(cache_size))) {
+		return false;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		reserved_cache_size = cache_size;
+	}
+
+	draw_program = create_shader_program(virtual_texture_vertex_shader_source, virtual_texture_fragment_shader_source);
+	feedback_program = create_shader_program(virtual_texture_vertex_shader_source, virtual_texture_feedback_shader_source);
+
+	if (!draw_program || !feedback_program) {
+		return false;
+	}
+
+	glUseProgram(draw_program);
+	glUniform1i(glGetUniformLocation(draw_program, "tile_cache"), 0);
+	glUniform1i(glGetUniformLocation(draw_program, "indirection"), 1);
+
+	cache_texture = create_cache_texture(cache_size);
+
+	float corners[] = {
+		0.0f, 0.0f,
+		1.0f, 0.0f,
+		0.0f, 1.0f,
+		1.0f, 1.0f
+	};
+
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+	glGenBuffers(1, &vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+	glEnableVertexAttribArray(0);
+	glBindVertexArray(0);
+
+	return true;
+}
+
+unsigned int Virtual_texture::create_cache_texture(int size) {
+	unsigned int texture;
+
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, size, size);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	return texture;
+}
+
+size_t Virtual_texture::shrink(size_t bytes_needed) {
+	size_t bytes_freed = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+
+		while (bytes_freed < bytes_needed && reserved_cache_size / 2 / tile_size >= min_slots_per_row) {
+			bytes_freed += get_cache_bytes(reserved_cache_size) - get_cache_bytes(reserved_cache_size / 2);
+			reserved_cache_size /= 2;
+		}
+	}
+
+	// The texture itself is replaced in the next update
+	Memory_governor::get().release(memory_stream_id, Memory_category::cache, bytes_freed);
+
+	return bytes_freed;
+}
+
+void Virtual_texture::shrink_cache(int new_cache_size) {
+	int new_slots_per_row = new_cache_size / tile_size;
+	size_t num_slots = static_cast<size_t>(new_slots_per_row) * new_slots_per_row;
+	auto new_texture = create_cache_texture(new_cache_size);
+	std::vector<std::pair<long long, long long>> tiles;
+
+	// Keep the most recently used tiles that fit, and evict the rest
+	for (auto& [key, tile] : resident_tiles) {
+		tiles.push_back({ tile.last_used, key });
+	}
+
+	std::sort(tiles.begin(), tiles.end(), std::greater<std::pair<long long, long long>>());
+	tiles.resize(std::min(tiles.size(), num_slots));
+
+	std::unordered_map<long long, Resident_tile> kept_tiles;
+	int slot = 0;
+
+	for (auto& [last_used, key] : tiles) {
+		auto& tile = resident_tiles[key];
+
+		glCopyImageSubData(cache_texture, GL_TEXTURE_2D, 0, (tile.slot % slots_per_row) * tile_size, (tile.slot / slots_per_row) * tile_size, 0,
+			new_texture, GL_TEXTURE_2D, 0, (slot % new_slots_per_row) * tile_size, (slot / new_slots_per_row) * tile_size, 0, tile_size, tile_size, 1);
+		kept_tiles[key] = { slot++, tile.frame_number, tile.last_used };
+	}
+
+	stats.num_evictions += static_cast<int>(resident_tiles.size() - kept_tiles.size());
+	LOG_INFO("Virtual texture cache shrunk from %d to %d, %zu of %zu tiles kept", cache_size, new_cache_size, kept_tiles.size(), resident_tiles.size());
+
+	glDeleteTextures(1, &cache_texture);
+	cache_texture = new_texture;
+	cache_size = new_cache_size;
+	slots_per_row = new_slots_per_row;
+	resident_tiles.swap(kept_tiles);
+	free_slots.clear();
+
+	// Backwards, so slots are handed out from the start
+	for (int free_slot = static_cast<int>(num_slots) - 1; free_slot >= slot; free_slot--) {
+		free_slots.push_back(free_slot);
+	}
+}
+
+long long Virtual_texture::make_tile_key(int level, int x, int y) {
+	return (static_cast<long long>(level) << 48) | (static_cast<long long>(y) << 24) | x;
+}
+
+void Virtual_texture::set_frame(const Decoded_frame& frame) {
+	this->frame = &frame;
+	frame_number++;
+	set_frame_size(frame.width, frame.height);
+}
+
+void Virtual_texture::set_frame_size(int width, int height) {
+	if (width == frame_width && height == frame_height) {
+		return;
+	}
+
+	// The current frame has the old size, so there is nothing to draw until the next one
+	if (frame && (static_cast<int>(frame->width) != width || static_cast<int>(frame->height) != height)) {
+		frame = nullptr;
+	}
+
+	// New size, so new tiles. Start over
+	frame_width = width;
+	frame_height = height;
+	level_tiles_x.clear();
+	level_tiles_y.clear();
+	level_offsets.clear();
+	indirection_height = 0;
+
+	// Down to the level where the whole frame is a single tile
+	for (int level = 0; level < max_levels; level++) {
+		int level_width = (frame_width + (1 << level) - 1) >> level;
+		int level_height = (frame_height + (1 << level) - 1) >> level;
+
+		level_tiles_x.push_back((level_width + tile_payload - 1) / tile_payload);
+		level_tiles_y.push_back((level_height + tile_payload - 1) / tile_payload);
+		level_offsets.push_back(indirection_height);
+		indirection_height += level_tiles_y.back();
+
+		if (level_tiles_x.back() == 1 && level_tiles_y.back() == 1) {
+			break;
+		}
+	}
+
+	num_levels = static_cast<int>(level_tiles_x.size());
+	level_offsets.resize(max_levels);
+
+	// The coarsest level is the fallback for everything, see read_feedback
+	if (level_tiles_x.back() != 1 || level_tiles_y.back() != 1) {
+		LOG_ERROR("%dx%d frames need more than %d levels. Only part of the frame is drawn at the coarsest level",
+			frame_width, frame_height, max_levels);
+	}
+
+	// Feedback that is still in flight refers to the old tiles
+	discard_feedback();
+	indirection_width = level_tiles_x[0];
+	indirection.assign(static_cast<size_t>(indirection_width) * indirection_height * 4, 0);
+
+	for (auto& [tile_key, tile] : resident_tiles) {
+		free_slots.push_back(tile.slot);
+	}
+
+	resident_tiles.clear();
+
+	if (indirection_texture) {
+		glDeleteTextures(1, &indirection_texture);
+	}
+
+	glGenTextures(1, &indirection_texture);
+	glBindTexture(GL_TEXTURE_2D, indirection_texture);
+	glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA16UI, indirection_width, indirection_height);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	LOG_DEBUG("Virtual texture for %dx%d frames: %d levels, %dx%d tiles at level 0", frame_width, frame_height, num_levels, level_tiles_x[0], level_tiles_y[0]);
+}
+
+bool Virtual_texture::create_feedback_framebuffer(int width, int height) {
+	if (feedback_framebuffer) {
+		glDeleteFramebuffers(1, &feedback_framebuffer);
+		glDeleteTextures(1, &feedback_texture);
+		feedback_framebuffer = 0;
+	}
+
+	glGenTextures(1, &feedback_texture);
+	glBindTexture(GL_TEXTURE_2D, feedback_texture);
+	glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA16UI, width, height);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, &feedback_framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, feedback_framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, feedback_texture, 0);
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		LOG_ERROR("Feedback framebuffer is not complete");
+		return false;
+	}
+
+	feedback_width = width;
+	feedback_height = height;
+
+	// Reads of the old size that are still in flight don't fit the new size
+	discard_feedback();
+
+	if (feedback_buffers.empty()) {
+		feedback_buffers.resize(num_feedback_buffers);
+
+		for (auto& feedback_buffer : feedback_buffers) {
+			glGenBuffers(1, &feedback_buffer.pbo);
+		}
+	}
+
+	for (auto& feedback_buffer : feedback_buffers) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, feedback_buffer.pbo);
+		glBufferData(GL_PIXEL_PACK_BUFFER, static_cast<GLsizeiptr>(width) * height * 4 * sizeof(uint32_t), nullptr, GL_STREAM_READ);
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	return true;
+}
+
+void Virtual_texture::discard_feedback() {
+	for (auto& feedback_buffer : feedback_buffers) {
+		if (feedback_buffer.fence) {
+			glDeleteSync(static_cast<GLsync>(feedback_buffer.fence));
+			feedback_buffer.fence = nullptr;
+		}
+	}
+
+	feedback_tile_keys.clear();
+}
+
+void Virtual_texture::draw_quad(unsigned int program, const Virtual_view& view) {
+	glUseProgram(program);
+	glUniform4f(glGetUniformLocation(program, "screen_rect"), view.x, view.y, view.width, view.height);
+	glUniform4f(glGetUniformLocation(program, "uv_rect"), view.u, view.v, view.u_size, view.v_size);
+	glUniform2i(glGetUniformLocation(program, "frame_size"), frame_width, frame_height);
+	glUniform1i(glGetUniformLocation(program, "tile_payload"), tile_payload);
+	glUniform1i(glGetUniformLocation(program, "num_levels"), num_levels);
+
+	glBindVertexArray(vao);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	glBindVertexArray(0);
+}
+
+void Virtual_texture::read_feedback(std::vector<long long>& tile_keys) {
+	size_t num_values = static_cast<size_t>(feedback_width) * feedback_height * 4;
+	auto& write_buffer = feedback_buffers[idx_next_feedback_buffer];
+
+	// The GPU is more than a ring behind. Drop the oldest read
+	if (write_buffer.fence) {
+		glDeleteSync(static_cast<GLsync>(write_buffer.fence));
+		write_buffer.fence = nullptr;
+	}
+
+	// With a pack buffer bound, this only queues the read
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, write_buffer.pbo);
+	glReadPixels(0, 0, feedback_width, feedback_height, GL_RGBA_INTEGER, GL_UNSIGNED_INT, nullptr);
+	write_buffer.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	idx_next_feedback_buffer = (idx_next_feedback_buffer + 1) % num_feedback_buffers;
+
+	// The newest earlier read the GPU has finished, oldest first. Fences signal in order, so stop at the first that hasn't
+	Feedback_buffer* ready_buffer = nullptr;
+
+	for (int i = 0; i < num_feedback_buffers - 1; i++) {
+		auto& feedback_buffer = feedback_buffers[(idx_next_feedback_buffer + i) % num_feedback_buffers];
+
+		if (!feedback_buffer.fence) {
+			continue;
+		}
+
+		auto status = glClientWaitSync(static_cast<GLsync>(feedback_buffer.fence), 0, 0);
+
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+			break;
+		}
+
+		if (ready_buffer) {
+			glDeleteSync(static_cast<GLsync>(ready_buffer->fence));
+			ready_buffer->fence = nullptr;
+		}
+
+		ready_buffer = &feedback_buffer;
+	}
+
+	// Until a newer read is done, the tiles of the last one are kept. A coarser level covers what they miss
+	if (ready_buffer) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, ready_buffer->pbo);
+		auto feedback_pixels = static_cast<const uint32_t*>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+			static_cast<GLsizeiptr>(num_values * sizeof(uint32_t)), GL_MAP_READ_BIT));
+
+		if (feedback_pixels) {
+			feedback_tile_keys.clear();
+
+			for (size_t i = 0; i < num_values; i += 4) {
+				if (!feedback_pixels[i + 3]) {
+					continue;
+				}
+
+				int x = feedback_pixels[i];
+				int y = feedback_pixels[i + 1];
+				int level = feedback_pixels[i + 2];
+
+				// With the coarser tiles, so there is always something to fall back to
+				for (; level < num_levels; level++, x /= 2, y /= 2) {
+					feedback_tile_keys.push_back(make_tile_key(level, x, y));
+				}
+			}
+
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			std::sort(feedback_tile_keys.begin(), feedback_tile_keys.end());
+			feedback_tile_keys.erase(std::unique(feedback_tile_keys.begin(), feedback_tile_keys.end()), feedback_tile_keys.end());
+		}
+
+		glDeleteSync(static_cast<GLsync>(ready_buffer->fence));
+		ready_buffer->fence = nullptr;
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	tile_keys = feedback_tile_keys;
+	tile_keys.push_back(make_tile_key(num_levels - 1, 0, 0));
+	std::sort(tile_keys.begin(), tile_keys.end());
+	tile_keys.erase(std::unique(tile_keys.begin(), tile_keys.end()), tile_keys.end());
+}
+
+void Virtual_texture::update(const Virtual_view& view, int viewport_width, int viewport_height) {
+	if (!frame) {
+		return;
+	}
+
+	update_number++;
+	stats.num_frames++;
+
+	int new_cache_size;
+
+	{
+		std::lock_guard<std::mutex> lock(cache_mutex);
+		new_cache_size = reserved_cache_size;
+	}
+
+	if (new_cache_size < cache_size) {
+		shrink_cache(new_cache_size);
+	}
+
+	int width = std::max(1, viewport_width / feedback_scale);
+	int height = std::max(1, viewport_height / feedback_scale);
+	GLint viewport[4];
+	GLint framebuffer;
+
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+
+	if ((width != feedback_width || height != feedback_height) && !create_feedback_framebuffer(width, height)) {
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		return;
+	}
+
+	// Feedback pass. The smaller viewport makes the derivatives larger, which the bias undoes
+	const GLuint clear_value[4] = { 0, 0, 0, 0 };
+
+	glBindFramebuffer(GL_FRAMEBUFFER, feedback_framebuffer);
+	glViewport(0, 0, feedback_width, feedback_height);
+	glClearBufferuiv(GL_COLOR, 0, clear_value);
+	glUseProgram(feedback_program);
+	glUniform1f(glGetUniformLocation(feedback_program, "lod_bias"), -std::log2(static_cast<float>(feedback_scale)));
+	draw_quad(feedback_program, view);
+
+	std::vector<long long> tile_keys;
+	read_feedback(tile_keys);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+	stats.num_tiles_requested += static_cast<int>(tile_keys.size());
+
+	// Coarse levels first, so if we run out of uploads or slots, the rest falls back to tiles that are current
+	std::sort(tile_keys.begin(), tile_keys.end(), std::greater<long long>());
+
+	for (auto tile_key : tile_keys) {
+		auto it = resident_tiles.find(tile_key);
+
+		if (it != resident_tiles.end()) {
+			it->second.last_used = update_number;
+		}
+	}
+
+	std::vector<std::pair<long long, long long>> eviction_candidates;
+	size_t idx_next_eviction = 0;
+	bool eviction_candidates_found = false;
+	int num_uploads = 0;
+
+	glBindTexture(GL_TEXTURE_2D, cache_texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	for (auto tile_key : tile_keys) {
+		if (num_uploads == max_uploads_per_frame) {
+			break;
+		}
+
+		auto it = resident_tiles.find(tile_key);
+
+		if (it != resident_tiles.end() && it->second.frame_number == frame_number) {
+			continue;
+		}
+
+		if (it == resident_tiles.end()) {
+			int slot;
+
+			if (!free_slots.empty()) {
+				slot = free_slots.back();
+				free_slots.pop_back();
+			}
+			else {
+				// Least recently used tiles that this view doesn't need
+				if (!eviction_candidates_found) {
+					for (auto& [key, tile] : resident_tiles) {
+						if (tile.last_used != update_number) {
+							eviction_candidates.push_back({ tile.last_used, key });
+						}
+					}
+
+					std::sort(eviction_candidates.begin(), eviction_candidates.end());
+					eviction_candidates_found = true;
+				}
+
+				if (idx_next_eviction == eviction_candidates.size()) {
+					LOG_WARNING_LIMITED(1, "Virtual texture cache is too small for the view");
+					break;
+				}
+
+				auto evicted = resident_tiles.find(eviction_candidates[idx_next_eviction++].second);
+				slot = evicted->second.slot;
+				resident_tiles.erase(evicted);
+				stats.num_evictions++;
+			}
+
+			it = resident_tiles.insert({ tile_key, { slot, 0, update_number } }).first;
+		}
+
+		int level = static_cast<int>(tile_key >> 48);
+		int y = static_cast<int>((tile_key >> 24) & 0xffffff);
+		int x = static_cast<int>(tile_key & 0xffffff);
+
+		convert_tile(level, x, y);
+		upload_tile(it->second.slot);
+		it->second.frame_number = frame_number;
+		num_uploads++;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	update_indirection();
+}
+
+void Virtual_texture::convert_tile(int level, int x, int y) {
+	int step = 1 << level;
+	int level_width = (frame_width + step - 1) >> level;
+	int level_height = (frame_height + step - 1) >> level;
+	int pitch = frame->pitch;
+	auto luma = frame->data.data();
+	auto chroma = luma + static_cast<size_t>(pitch) * frame->height;
+	auto pixel = tile_pixels.data();
+
+	for (int j = 0; j < tile_size; j++) {
+		// The first and last row and column are the border, copied from the neighbouring tiles
+		int source_y = std::clamp(y * tile_payload + j - 1, 0, level_height - 1) << level;
+		int source_y2 = std::min(source_y + step / 2, frame_height - 1);
+		auto chroma_row = chroma + static_cast<size_t>(source_y / 2) * pitch;
+
+		for (int i = 0; i < tile_size; i++) {
+			int source_x = std::clamp(x * tile_payload + i - 1, 0, level_width - 1) << level;
+			int source_x2 = std::min(source_x + step / 2, frame_width - 1);
+			// Box filter for the coarser levels. Only four samples, so the cost follows the tile size, not the area it covers
+			int c = luma[static_cast<size_t>(source_y) * pitch + source_x];
+
+			if (level) {
+				c = (c + luma[static_cast<size_t>(source_y) * pitch + source_x2] + luma[static_cast<size_t>(source_y2) * pitch + source_x]
+					+ luma[static_cast<size_t>(source_y2) * pitch + source_x2] + 2) / 4;
+			}
+
+			// BT.709, limited range, in 8.8 fixed point
+			c -= 16;
+			int d = chroma_row[source_x & ~1] - 128;
+			int e = chroma_row[(source_x & ~1) + 1] - 128;
+
+			pixel[0] = static_cast<unsigned char>(std::clamp((298 * c + 459 * e + 128) >> 8, 0, 255));
+			pixel[1] = static_cast<unsigned char>(std::clamp((298 * c - 55 * d - 136 * e + 128) >> 8, 0, 255));
+			pixel[2] = static_cast<unsigned char>(std::clamp((298 * c + 541 * d + 128) >> 8, 0, 255));
+			pixel[3] = 255;
+			pixel += 4;
+		}
+	}
+}
+
+void Virtual_texture::upload_tile(int slot) {
+	int x = (slot % slots_per_row) * tile_size;
+	int y = (slot / slots_per_row) * tile_size;
+
+	glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, tile_size, tile_size, GL_RGBA, GL_UNSIGNED_BYTE, tile_pixels.data());
+
+	stats.num_tiles_uploaded++;
+	stats.upload_bytes += tile_pixels.size();
+}
+
+void Virtual_texture::update_indirection() {
+	// Coarse to fine, so a tile that isn't current can take the entry of its parent
+	for (int level = num_levels - 1; level >= 0; level--) {
+		for (int y = 0; y < level_tiles_y[level]; y++) {
+			for (int x = 0; x < level_tiles_x[level]; x++) {
+				auto entry = &indirection[(static_cast<size_t>(level_offsets[level] + y) * indirection_width + x) * 4];
+				auto it = resident_tiles.find(make_tile_key(level, x, y));
+
+				// The last level only has the root tile, which is always uploaded first
+				if (it != resident_tiles.end() && (it->second.frame_number == frame_number || level == num_levels - 1)) {
+					entry[0] = static_cast<uint16_t>(it->second.slot % slots_per_row);
+					entry[1] = static_cast<uint16_t>(it->second.slot / slots_per_row);
+					entry[2] = static_cast<uint16_t>(level);
+				}
+				else if (level < num_levels - 1) {
+					auto parent_entry = &indirection[(static_cast<size_t>(level_offsets[level + 1] + y / 2) * indirection_width + x / 2) * 4];
+					std::copy(parent_entry, parent_entry + 4, entry);
+				}
+			}
+		}
+	}
+
+	glBindTexture(GL_TEXTURE_2D, indirection_texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, indirection_width, indirection_height, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, indirection.data());
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void Virtual_texture::draw(const Virtual_view& view) {
+	if (!frame) {
+		return;
+	}
+
+	glUseProgram(draw_program);
+	glUniform1f(glGetUniformLocation(draw_program, "lod_bias"), 0.0f);
+	glUniform1iv(glGetUniformLocation(draw_program, "level_offsets"), max_levels, level_offsets.data());
+	glUniform1i(glGetUniformLocation(draw_program, "tile_size"), tile_size);
+	glUniform1f(glGetUniformLocation(draw_program, "cache_size"), static_cast<float>(cache_size));
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, cache_texture);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, indirection_texture);
+	glActiveTexture(GL_TEXTURE0);
+
+	draw_quad(draw_program, view);
+}
+
+Virtual_texture_stats Virtual_texture::get_stats() {
+	auto current_stats = stats;
+	stats = Virtual_texture_stats();
+
+	return current_stats;
+}
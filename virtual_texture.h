@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+class Decoded_frame;
+
+/**
+ * @brief Which part of the frame to draw where
+*/
+struct Virtual_view {
+	/**
+	 * @brief Screen rectangle in normalized device coordinates, from the bottom left corner
+	*/
+	float x;
+	float y;
+	float width;
+	float height;
+	/**
+	 * @brief Visible part of the frame, as fractions of the frame size, from the top left corner
+	*/
+	float u = 0.0f;
+	float v = 0.0f;
+	float u_size = 1.0f;
+	float v_size = 1.0f;
+};
+
+/**
+ * @brief Counters since the last call to Virtual_texture::get_stats
+*/
+struct Virtual_texture_stats {
+	int num_frames = 0;
+	int num_tiles_requested = 0;
+	int num_tiles_uploaded = 0;
+	size_t upload_bytes = 0;
+	int num_evictions = 0;
+};
+
+/**
+ * @brief Draws very large frames (8K and above, panoramas) without uploading the whole frame. The frame
+ * is split into tiles at several mip levels. A feedback pass renders the view at low resolution and
+ * writes which tile and level each pixel samples. Only those tiles are converted to RGB and uploaded,
+ * into slots of a physical tile cache texture. An indirection table maps each tile to its slot; tiles
+ * that aren't resident use the closest coarser level that is. So the upload cost follows the screen
+ * coverage of the frame, not its resolution. When the memory governor needs memory for other streams,
+ * the tile cache is halved, keeping the most recently used tiles. Needs a current OpenGL 4.3 context
+*/
+class Virtual_texture {
+public:
+	/**
+	 * @param tile_size Size of a tile slot in the cache, including a one pixel border for filtering
+	 * @param cache_size Width and height of the tile cache texture
+	 * @param max_uploads_per_frame Tiles uploaded per frame at most. Coarse tiles go first, so
+	 * the rest is drawn from a coarser level until the next frame
+	*/
+	Virtual_texture(int tile_size = 128, int cache_size = 4096, int max_uploads_per_frame = 512);
+	~Virtual_texture();
+
+	/**
+	 * @brief Creates the textures, framebuffer and shader programs
+	 * @return True on success, false otherwise
+	*/
+	bool init();
+
+	/**
+	 * @brief Sets the frame to draw. Only the tiles that are visible are converted, in update, so the
+	 * frame must stay valid until then. Resident tiles of the previous frame are used until replaced
+	 * @param frame NV12 frame
+	*/
+	void set_frame(const Decoded_frame& frame);
+
+	/**
+	 * @brief Prepares for frames of a new size, eg. from a decoder's format callback, so the tile layout
+	 * and indirection texture are ready before the first frame arrives. set_frame does this too
+	*/
+	void set_frame_size(int width, int height);
+
+	/**
+	 * @brief Runs the feedback pass for the view, and uploads the tiles it needs. The feedback is read back
+	 * without waiting for the GPU, so the tiles follow the view a frame or two late
+	 * @param view Where the frame will be drawn
+	 * @param viewport_width Width of the viewport the frame will be drawn in
+	 * @param viewport_height Height of the viewport the frame will be drawn in
+	*/
+	void update(const Virtual_view& view, int viewport_width, int viewport_height);
+
+	/**
+	 * @brief Draws the frame with the tiles uploaded by update
+	*/
+	void draw(const Virtual_view& view);
+
+	Virtual_texture_stats get_stats();
+private:
+	struct Resident_tile {
+		int slot;
+		long long frame_number;
+		long long last_used;
+	};
+
+	long long make_tile_key(int level, int x, int y);
+	void read_feedback(std::vector<long long>& tile_keys);
+	void convert_tile(int level, int x, int y);
+	void upload_tile(int slot);
+	void update_indirection();
+	unsigned int create_cache_texture(int size);
+	void shrink_cache(int new_cache_size);
+	size_t shrink(size_t bytes_needed);
+	bool create_feedback_framebuffer(int width, int height);
+	void discard_feedback();
+	void draw_quad(unsigned int program, const Virtual_view& view);
+	int tile_size;
+	int tile_payload;
+	int cache_size;
+	int slots_per_row;
+	int max_uploads_per_frame;
+	const Decoded_frame* frame = nullptr;
+	int frame_width = 0;
+	int frame_height = 0;
+	long long frame_number = 0;
+	long long update_number = 0;
+	int num_levels = 0;
+	std::vector<int> level_tiles_x;
+	std::vector<int> level_tiles_y;
+	std::vector<int> level_offsets;
+	std::unordered_map<long long, Resident_tile> resident_tiles;
+	std::vector<int> free_slots;
+	std::vector<uint16_t> indirection;
+	int indirection_width = 0;
+	int indirection_height = 0;
+	std::vector<unsigned char> tile_pixels;
+	/**
+	 * @brief Pixel buffer the feedback is read into, and the fence (a GLsync) that signals when the read
+	 * is done. The fence is null when no read is pending
+	*/
+	struct Feedback_buffer {
+		unsigned int pbo = 0;
+		void* fence = nullptr;
+	};
+
+	std::vector<Feedback_buffer> feedback_buffers;
+	int idx_next_feedback_buffer = 0;
+	/**
+	 * @brief Tiles of the latest feedback that was read back
+	*/
+	std::vector<long long> feedback_tile_keys;
+	unsigned int cache_texture = 0;
+	unsigned int indirection_texture = 0;
+	unsigned int feedback_texture = 0;
+	unsigned int feedback_framebuffer = 0;
+	int feedback_width = 0;
+	int feedback_height = 0;
+	unsigned int draw_program = 0;
+	unsigned int feedback_program = 0;
+	unsigned int vao = 0;
+	unsigned int vbo = 0;
+	int memory_stream_id = -1;
+	/**
+	 * @brief Cache size after the shrinks so far, 0 before the cache is reserved. The texture can only
+	 * be replaced on the thread with the OpenGL context, so update applies it
+	*/
+	int reserved_cache_size = 0;
+	std::mutex cache_mutex;
+	Virtual_texture_stats stats;
+};